@@ -27,14 +27,18 @@
 #include <linux/fb.h>
 #include <sys/mman.h>
 #include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <pthread.h>
 
 #include "pil.h"
 #include "pil_io.h"
 
 #include <spi_lcd.h>
 
-#define MAX_PATH 260
-static char szIn[MAX_PATH];
+#define STREAM_WINDOW 0x100000 // --stream: bytes of the file kept in memory (grows for larger frames)
+static char **pInList; // files to play in order (--in, --list or trailing names)
+static int iInCount, iInMax;
 int bCenter, iLoopCount;
 int fbfd, iPitch;
 char szDev[32];
@@ -42,10 +46,30 @@ struct fb_var_screeninfo vinfo;
 struct fb_fix_screeninfo finfo;
 long int screensize = 0;
 char *fbp = 0;
-static int bLCD;
-extern void PILCountGIFPages(PIL_FILE *pFile);
+static int bLCD, bLowMem, bFused, bIndex, bStream, bScan, bBigEndian, iThreads;
+static int iScanNext; // --scan: next entry of pInList for a worker to take
+// One GIF being played (or being made ready to play next). The fields up
+// to iErr belong to whoever is opening or playing the file, which is the
+// prefetch thread while it runs; the rest are only touched by the main thread.
+typedef struct gp_gif_tag
+{
+	PIL_FILE pf;
+	PIL_PAGE pp1;          // header of the frame being drawn
+	PIL_PAGE pp2;          // the animation page that's shown
+	PIL_PAGE ppSrc;        // decoded frame (unless it's drawn straight onto pp2)
+	char *szName;
+	char *szIndex;         // --index sidecar file (<szName>.gpi)
+	uint32_t u32Stamp;     // modification time the index is tied to
+	int bWriteIndex;       // save the index once the scan reaches the end
+	int bOpen;             // OpenGIF() succeeded, CloseGIF() has something to free
+	int bFirstFrame;       // frame 0 is already drawn on pp2
+	int iErr;              // result of PrepareGIF(), read once its thread is joined
+	char *szNext;          // file for PrepareGIF() to open in this slot
+	pthread_t tid;
+	int bThread;           // PrepareGIF() is running on tid
+} GP_GIF;
 extern int PILReadGIF(PIL_PAGE *pPage, PIL_FILE *pFile, int iRequestedPage);
-extern int PILDecodeLZW(PIL_PAGE *pIn, PIL_PAGE *pOut, PILBOOL bGIF, int iOptions);
+extern int PILDecodeGIF(PIL_FILE *pFile, PIL_PAGE *pIn, PIL_PAGE *pOut, int iOptions);
 //
 // Current time in milliseconds
 //
@@ -69,30 +93,46 @@ void ShowHelp(void)
 	"gp - play GIF files directly onto the framebuffer"
 	"usage: ./gp <options>\n"
 	"valid options:\n\n"
-        " --in <infile>       Input file\n"
+        " --in <infile>       Input file (repeat it, or list more files after the options, for a playlist)\n"
+	" --list <file>       Play the files named in <file>, one per line\n"
 	" --c                 Center on the display\n"
         " --dev <device>      Destination device (defaults to fb0), or lcd\n"
 	" --loop N            Loop the animation N times\n"
+	" --lowmem            Decode each frame a row at a time (no frame buffer)\n"
+	" --fused             Decode each frame straight onto the display page\n"
+	" --index             Keep the frame index in <infile>.gpi to skip the scan\n"
+	" --stream            Read frames from the file as they're played (for files larger than RAM)\n"
+	" --be565             LCD: draw in big-endian RGB565, the panel's byte order, for drivers\n"
+	"                     that send tiles as they are\n"
+	" --scan              Print the size, frames, duration and colors of each file as JSON lines\n"
+	"                     instead of playing them (directories are searched for .gif files)\n"
+	" --threads N         Number of files --scan works on at once (defaults to one per CPU)\n"
     );
 }
 //
 // Display the current GIF frame on the framebuffer
+// Only the areas the last frame changed (pPage->rDirty) are copied unless
+// bAll is set because the display doesn't show this page yet
 //
-void ShowFrame(PIL_PAGE *pPage)
+void ShowFrame(PIL_PAGE *pPage, int bAll)
 {
-int tx, ty, cx, cy, x, y, w, h;
+int tx, ty, cx, cy, x, y, w, h, i, iCount, iBpp;
+int x0, y0, x1, y1;
 unsigned char *s, *d;
+PILRECT rAll, *pRects;
 
-	tx = ty = 16;
 	w = pPage->iWidth;
 	h = pPage->iHeight;
 	d = NULL;
+	if (bLCD) // only the visible part of the page was drawn
+	{
+		if (w > 320) w = 320;
+		if (h > 240) h = 240;
+	}
 	if (bCenter)
 	{
 		if (bLCD)
 		{
-		if (w > 320) w = 320;
-		if (h > 240) h = 240;
 		cx = (320 - w)/2;
 		cy = (240 - h)/2;
 		}
@@ -106,36 +146,108 @@ unsigned char *s, *d;
 	{
 		cx = cy = 0;
 	}
+	if (bAll)
+	{
+		rAll.Left = rAll.Top = 0;
+		rAll.Right = w;
+		rAll.Bottom = h;
+		pRects = &rAll;
+		iCount = 1;
+	}
+	else
+	{
+		pRects = pPage->rDirty;
+		iCount = pPage->iDirtyCount;
+	}
+	iBpp = pPage->cBitsperpixel / 8;
+	for (i=0; i<iCount; i++)
+	{
+	x0 = pRects[i].Left;
+	y0 = pRects[i].Top;
+	x1 = ((int)pRects[i].Right < w) ? (int)pRects[i].Right : w;
+	y1 = ((int)pRects[i].Bottom < h) ? (int)pRects[i].Bottom : h;
 	if (bLCD)
 	{
-	for (y=0; y<h; y+=16)
+	for (y=y0; y<y1; y+=16)
 	{
 		ty = 16;
-		if (h - y < 16)
-			ty = h - y;
-		for (x=0; x<w; x+=16)
+		if (y1 - y < 16)
+			ty = y1 - y;
+		for (x=x0; x<x1; x+=16)
 		{
 			s = pPage->pData + (y * pPage->iPitch) + x * 2;
 			tx = 16;
-			if (w - x < 16)
-				tx = w - x;
+			if (x1 - x < 16)
+				tx = x1 - x;
 			spilcdDrawTile(x+cx,y+cy, tx, ty, s, pPage->iPitch);
 		}
 	} // for y
 	}
-	else
+	else if (x1 > x0)
 	{
-	d = (unsigned char *)fbp + (cy * iPitch) + ((cx * vinfo.bits_per_pixel)/8);	
-	s = pPage->pData;
-	for (y=0; y<pPage->iHeight; y++)
+	d = (unsigned char *)fbp + ((cy + y0) * iPitch) + ((cx + x0) * iBpp);
+	s = pPage->pData + (y0 * pPage->iPitch) + (x0 * iBpp);
+	for (y=y0; y<y1; y++)
 	{
-		memcpy(d, s, pPage->iPitch);
+		memcpy(d, s, (x1 - x0) * iBpp);
 		d += iPitch;
 		s += pPage->iPitch;
 	}
 	}
+	} // for each rectangle
 } /* ShowFrame() */
 
+//
+// Add a file to the end of the playlist
+//
+static void AddInput(char *szName)
+{
+	if (iInCount == iInMax)
+	{
+		iInMax = (iInMax) ? iInMax * 2 : 16;
+		pInList = PILIOReAlloc(pInList, iInMax * sizeof(char *));
+		if (pInList == NULL)
+		{
+			printf("Out of memory\n");
+			exit(1);
+		}
+	}
+	pInList[iInCount] = strdup(szName);
+	if (pInList[iInCount] == NULL)
+	{
+		printf("Out of memory\n");
+		exit(1);
+	}
+	iInCount++;
+} /* AddInput() */
+//
+// Add the files named in a list file (one per line, blank lines and
+// lines starting with # are skipped)
+//
+static void ReadList(char *szList)
+{
+FILE *f;
+char *szLine = NULL;
+size_t iSize = 0;
+ssize_t iLen;
+
+	f = fopen(szList, "r");
+	if (f == NULL)
+	{
+		fprintf(stderr, "Unable to open list file '%s'\n", szList);
+		exit(1);
+	}
+	while ((iLen = getline(&szLine, &iSize, f)) != -1) // whole lines, however long the name
+	{
+		while (iLen > 0 && (szLine[iLen-1] == '\n' || szLine[iLen-1] == '\r'))
+			szLine[--iLen] = '\0';
+		if (iLen > 0 && szLine[0] != '#')
+			AddInput(szLine);
+	}
+	free(szLine);
+	fclose(f);
+} /* ReadList() */
+
 static void parse_opts(int argc, char *argv[])
 {
 // set default options
@@ -143,9 +255,9 @@ int i = 1;
 
     bCenter = 0;
     bLCD = 0;
+    bLowMem = 0;
     iLoopCount = 1;
     strcpy(szDev, "fb0"); // destination frame buffer
-    szIn[0] = '\0';
 
     while (i < argc)
     {
@@ -162,7 +274,10 @@ int i = 1;
         }
         /* test for each specific flag */
         if (0 == strcmp("--in", argv[i])) {
-            strcpy(szIn, argv[i+1]);
+            AddInput(argv[i+1]);
+            i += 2;
+        } else if (0 == strcmp("--list", argv[i])) {
+            ReadList(argv[i+1]);
             i += 2;
 	} else if (0 == strcmp("--dev", argv[i])) {
 	    strcpy(szDev,argv[i+1]);
@@ -174,27 +289,522 @@ int i = 1;
         } else if (0 == strcmp("--loop", argv[i])) {
             iLoopCount = atoi(argv[i+1]);
             i += 2;
+        } else if (0 == strcmp("--lowmem", argv[i])) {
+            i ++;
+            bLowMem = 1;
+        } else if (0 == strcmp("--fused", argv[i])) {
+            i ++;
+            bFused = 1;
+        } else if (0 == strcmp("--index", argv[i])) {
+            i ++;
+            bIndex = 1;
+        } else if (0 == strcmp("--stream", argv[i])) {
+            i ++;
+            bStream = 1;
+        } else if (0 == strcmp("--be565", argv[i])) {
+            i ++;
+            bBigEndian = 1;
+        } else if (0 == strcmp("--scan", argv[i])) {
+            i ++;
+            bScan = 1;
+        } else if (0 == strcmp("--threads", argv[i])) {
+            iThreads = atoi(argv[i+1]);
+            i += 2;
 	}  else {
             fprintf(stderr, "Unknown parameter '%s'\n", argv[i]);
             exit(1);
         }
     }
-    if (strlen(szIn) == 0)
+    while (i < argc) // anything after the options is more files to play
+        AddInput(argv[i++]);
+    if (iInCount == 0)
     {
        printf("Must specify an input filename\n");
        exit(1);
     }
 } /* parse_opts() */
 
-int main( int argc, char *argv[ ], char *envp[ ] )
+//
+// Open a GIF file and get it ready to play: find its first frame and
+// allocate the pages and decoder it's drawn with
+//
+static int OpenGIF(GP_GIF *pGIF, char *szName)
 {
-PIL_FILE pf;
-PIL_PAGE pp1, pp2;
+PIL_FILE *pf = &pGIF->pf;
+char szTemp[32];
+struct stat st;
+void *pFile;
+
+	// only the file's own state is reset, the playlist fields of the slot
+	// belong to the main thread
+	memset(&pGIF->pf, 0, sizeof(PIL_FILE));
+	memset(&pGIF->pp1, 0, sizeof(PIL_PAGE));
+	memset(&pGIF->pp2, 0, sizeof(PIL_PAGE));
+	memset(&pGIF->ppSrc, 0, sizeof(PIL_PAGE));
+	pGIF->szIndex = NULL;
+	pGIF->u32Stamp = 0;
+	pGIF->bWriteIndex = 0;
+	pGIF->bFirstFrame = 0;
+	pGIF->szName = szName;
+	pFile = PILIOOpenRO(szName);
+	if (pFile == (void *)-1)
+	{
+		printf("Unable to open %s\n", szName);
+		return -1;
+	}
+	pf->cFileType = PIL_FILE_GIF;
+	pf->iFile = pFile;
+	pf->iFileSize = PILIOSize(pFile);
+	if (pf->iFileSize < 13) // too short for the GIF header and screen descriptor
+	{
+		printf("Not a GIF file\n");
+		PILIOClose(pFile);
+		return -1;
+	}
+	if (bStream) // leave the file open, frames are read as they're needed
+	{
+		pf->cState = PIL_FILE_STATE_OPEN;
+		if (PILIORead(pFile, szTemp, 5) != 5 || memcmp(szTemp,"GIF89",5) != 0) // not a GIF
+		{
+			printf("Not a GIF file\n");
+			PILIOClose(pFile);
+			return -1;
+		}
+	}
+	else
+	{
+		// map the file into memory (no copy, and the page cache is shared with
+		// other players of the same file), or read it entirely if that fails
+		pf->cState = PIL_FILE_STATE_LOADED;
+		pf->pData = PILIOMap(pFile, pf->iFileSize);
+		if (pf->pData)
+			pf->bMapped = 1;
+		else
+		{
+			pf->pData = PILIOAlloc((int)pf->iFileSize);
+			if (pf->pData == NULL || PILIORead(pFile, pf->pData, (int)pf->iFileSize) != (int)pf->iFileSize)
+			{
+				printf("Unable to read %s\n", szName);
+				if (pf->pData)
+					PILIOFree(pf->pData);
+				pf->pData = NULL;
+				PILIOClose(pFile);
+				return -1;
+			}
+		}
+		PILIOClose(pFile);
+		if (memcmp(pf->pData,"GIF89",5) != 0) // not a GIF
+		{
+			printf("Not a GIF file\n");
+			if (!pf->bMapped)
+				PILIOFree(pf->pData);
+			PILClose(pf); // unmaps it otherwise
+			return -1;
+		}
+	}
+	pGIF->bOpen = 1; // CloseGIF() takes care of it from here on
+	// The sidecar index is tied to this exact file by its size, a hash
+	// of its header and the modification time
+	if (bIndex && stat(szName, &st) == 0 && (pGIF->szIndex = malloc(strlen(szName) + 5)) != NULL)
+	{
+		sprintf(pGIF->szIndex, "%s.gpi", szName);
+		pGIF->u32Stamp = (uint32_t)st.st_mtime;
+		if (PILReadGIFIndex(pf, pGIF->szIndex, pGIF->u32Stamp) != 0)
+			pGIF->bWriteIndex = 1; // save it once the scan reaches the end
+	}
+	// Only the first frame is located up front, the rest are found as
+	// they're needed so playback starts right away
+	PILScanGIFPages(pf, 1);
+	if (bStream && PILGIFSetWindow(pf, STREAM_WINDOW) != 0)
+	{
+		printf("Out of memory\n");
+		return -1;
+	}
+	// The animation page, the source page, the decoded frame buffer and
+	// the decoder context are allocated once and reused for every frame
+	pGIF->pp2.iWidth = pf->iX;
+	pGIF->pp2.iHeight = pf->iY;
+	// The page is drawn in the display's own pixel format; only the
+	// palette is converted for each frame
+	if (bLCD)
+	{
+		pGIF->pp2.cBitsperpixel = 16;
+		if (bBigEndian)
+			pGIF->pp2.cGIFFormat = PIL_GIF_FORMAT_RGB565_BE;
+	}
+	else
+	{
+		pGIF->pp2.cBitsperpixel = vinfo.bits_per_pixel; // has to be same as display
+		if (vinfo.bits_per_pixel == 8)
+			pGIF->pp2.cGIFFormat = PIL_GIF_FORMAT_RGB332;
+	}
+	pGIF->pp2.iPitch = (pGIF->pp2.iWidth * pGIF->pp2.cBitsperpixel)/8;
+	pGIF->pp2.pData = PILIOAlloc(pGIF->pp2.iPitch * pGIF->pp2.iHeight);
+	pGIF->pp2.iDataSize = pGIF->pp2.iPitch * pGIF->pp2.iHeight;
+	pGIF->pp2.cFlags = PIL_PAGEFLAGS_TOPDOWN;
+	pGIF->pp2.cCompression = PIL_COMP_NONE;
+	pGIF->pp2.pPalette = PILIOAlloc(2048);
+	if (bLCD) // pixels past the 320x240 panel are never shown, don't draw them
+	{
+		pGIF->pp2.iViewCX = 320;
+		pGIF->pp2.iViewCY = 240;
+	}
+	pGIF->ppSrc.pData = PILIOAlloc((pGIF->pp2.iWidth + 4) * pGIF->pp2.iHeight + 4); // room for any frame that fits on the canvas (8 or 4bpp)
+	pf->pGIFLZW = PILGIFLZWCreate();
+	if (pGIF->pp2.pData == NULL || pGIF->pp2.pPalette == NULL || pGIF->ppSrc.pData == NULL || pf->pGIFLZW == NULL)
+	{
+		printf("Out of memory\n");
+		return -1;
+	}
+	return 0;
+} /* OpenGIF() */
+//
+// Free everything OpenGIF() set up
+//
+static void CloseGIF(GP_GIF *pGIF)
+{
+	if (!pGIF->bOpen)
+		return;
+	PILFree(&pGIF->ppSrc);
+	PILFree(&pGIF->pp1);
+	PILFree(&pGIF->pp2);
+	PILGIFLZWDestroy(pGIF->pf.pGIFLZW);
+	pGIF->pf.pGIFLZW = NULL;
+	if (pGIF->pf.cState == PIL_FILE_STATE_LOADED && !pGIF->pf.bMapped)
+		PILIOFree(pGIF->pf.pData);
+	PILClose(&pGIF->pf);
+	free(pGIF->szIndex);
+	pGIF->szIndex = NULL;
+	pGIF->bOpen = 0;
+} /* CloseGIF() */
+//
+// Decode frame i and draw it on the animation page
+// returns 0 for success, -1 if the file can't be played any further or
+// the PILAnimate error code if just this frame couldn't be drawn
+//
+static int DrawGIFFrame(GP_GIF *pGIF, int i)
+{
+PIL_FILE *pf = &pGIF->pf;
+PIL_PAGE *pp1 = &pGIF->pp1, *pp2 = &pGIF->pp2, *ppSrc = &pGIF->ppSrc;
+PIL_GIF_ANIM anim;
 int err;
-int i, rc, iLoop;
+
+//			printf("About to call PILReadGIF\n");
+	                err = PILReadGIF(pp1, pf, i);
+        	        if (err)
+                	{       
+                        	printf("PILReadGIF returned %d, datasize=%d\n", err, pp1->iDataSize);
+                        	return -1;
+                	}
+
+			if (i == 0) // get global color table from first frame
+			{
+				memcpy(pp2->pPalette, pp1->pPalette, 768);
+			}
+			if (pp1->iX + pp1->iWidth > pp2->iWidth || pp1->iY + pp1->iHeight > pp2->iHeight)
+			{
+				err = PIL_ERROR_INVPARAM; // frame doesn't fit on the canvas
+			}
+			else if (bLowMem) // draw each row on the animation page as soon as it's decoded
+			{
+				err = PILAnimateGIFStart(pp2, pp1, &anim);
+				if (err == 0)
+				{
+					anim.iSrcBpp = 8; // the rows are always 1 byte per pixel
+					err = PILDecodeGIFRows(pf, pp1, PILAnimateGIFLine, &anim, 0);
+					PILAnimateGIFEnd(&anim);
+					if (err)
+					{
+						printf("PILDecodeGIFRows returned %d\n", err);
+						return -1;
+					}
+				}
+			}
+			else if (bFused) // decode and draw the frame on the animation page in one pass
+			{
+				err = PILDecodeGIFCanvas(pf, pp1, pp2, 0);
+				if (err)
+				{
+					printf("PILDecodeGIFCanvas returned %d\n", err);
+					return -1;
+				}
+			}
+			else
+			{
+			ppSrc->cCompression = PIL_COMP_NONE;
+			err = PILDecodeGIF(pf, pp1, ppSrc, PIL_CONVERT_NOALLOC | PIL_CONVERT_8BPP);
+			if (err)
+			{
+				printf("PILDecodeGIF returned %d\n", err);
+				return -1;
+			}
+//			printf("About to call PILAnimateGIF, framedelay = %d\n", pp2->iFrameDelay);
+			err = PILAnimateGIF(pp2, ppSrc);
+//			printf("returned from PILAnimateGIF\n");
+			}
+	return err;
+} /* DrawGIFFrame() */
+//
+// Open a GIF and draw its first frame so it can be shown the moment the
+// one before it ends. Runs on its own thread while the playlist plays.
+//
+static void * PrepareGIF(void *pArg)
+{
+GP_GIF *pGIF = (GP_GIF *)pArg;
+char *szName = pGIF->szNext;
+
+	CloseGIF(pGIF); // the slot still holds the file played before the current one
+	pGIF->iErr = OpenGIF(pGIF, szName);
+	if (pGIF->iErr == 0)
+	{
+		pGIF->iErr = DrawGIFFrame(pGIF, 0);
+		pGIF->bFirstFrame = (pGIF->iErr == 0);
+	}
+	return NULL;
+} /* PrepareGIF() */
+//
+// Play every frame of a GIF iLoopCount times. Once the first frame is
+// shown, the next file of the playlist (pNext->szNext) is prepared in
+// the background.
+//
+static int PlayGIF(GP_GIF *pGIF, GP_GIF *pNext)
+{
+PIL_FILE *pf = &pGIF->pf;
+int err, rc;
+int i, iLoop;
 int iTime;
-char szTemp[32];
+int bAll; // the display doesn't show this page yet, copy all of it
+
+		rc = 0;
+		bAll = 1;
+		for (iLoop=0; iLoop<iLoopCount && rc == 0; iLoop++)
+		{
+		for (i=0; i<pf->iPageTotal || pf->pGIFScan; i++)
+		{
+			iTime = MilliTime(); // get the current time in milliseconds
+			if (i >= pf->iPageTotal && PILScanGIFPages(pf, i+1) <= i)
+				break; // the scan reached the end of the file
+			if (i == 0 && pGIF->bFirstFrame) // drawn while the last file played
+			{
+				pGIF->bFirstFrame = 0;
+				err = 0;
+			}
+			else
+				err = DrawGIFFrame(pGIF, i);
+			if (err < 0)
+			{
+				rc = -1;
+				break;
+			}
+			if (err == 0)
+			{
+				ShowFrame(&pGIF->pp2, bAll);
+				bAll = 0;
+				if (!pNext->bThread && pNext->szNext) // the slot is the prefetch thread's once it starts
+				{
+					pNext->bThread = 1; // only this thread reads or writes it
+					if (pthread_create(&pNext->tid, NULL, PrepareGIF, pNext) != 0)
+						pNext->bThread = 0;
+				}
+				iTime = MilliTime() - iTime; // number of milliseconds that have passed so far for this frame
+				iTime = pGIF->pp1.iFrameDelay - iTime; // any time left for the frame delay?
+				if (iTime > 0)
+					usleep(iTime * 1000); // frame delay in ms (accounting for time spent decoding + displaying)
+			}
+			else
+			{
+				printf("Frame: %d, PILAnimate returned %d\n", i, err);
+				bAll = 1; // it may have been partly drawn
+			}
+		} // for each frame
+		if (pGIF->bWriteIndex && pf->pGIFScan == NULL)
+		{
+			PILWriteGIFIndex(pf, pGIF->szIndex, pGIF->u32Stamp); // best effort, e.g. read-only media
+			pGIF->bWriteIndex = 0;
+		}
+		} // for each loop over the animation
+	if (pNext->bThread)
+	{
+		pthread_join(pNext->tid, NULL);
+		pNext->bThread = 0;
+	}
+	else if (pNext->szNext) // nothing was shown, get it ready now
+		PrepareGIF(pNext);
+	return rc;
+} /* PlayGIF() */
+
+//
+// Copy a string into a JSON string literal
+//
+static void JSONString(char *d, const char *s, int iLen)
+{
+char *pEnd = &d[iLen - 8]; // room for the longest escape, the quote and the terminator
+
+	*d++ = '"';
+	while (*s && d < pEnd)
+	{
+		unsigned char c = (unsigned char)*s++;
+		if (c == '"' || c == '\\')
+		{
+			*d++ = '\\';
+			*d++ = (char)c;
+		}
+		else if (c < 0x20)
+			d += sprintf(d, "\\u%04x", c);
+		else
+			*d++ = (char)c;
+	}
+	*d++ = '"';
+	*d = '\0';
+} /* JSONString() */
+//
+// Add the .gif files found in a directory and its subdirectories to the list
+//
+static void AddDirectory(char *szDir)
+{
+DIR *pDir;
+struct dirent *pEnt;
+struct stat st;
+char szPath[4096];
+int iLen, bDir;
+
+	pDir = opendir(szDir);
+	if (pDir == NULL)
+	{
+		fprintf(stderr, "Unable to read directory '%s'\n", szDir);
+		return;
+	}
+	while ((pEnt = readdir(pDir)) != NULL)
+	{
+		if (strcmp(pEnt->d_name, ".") == 0 || strcmp(pEnt->d_name, "..") == 0)
+			continue;
+		if (snprintf(szPath, sizeof(szPath), "%s/%s", szDir, pEnt->d_name) >= (int)sizeof(szPath))
+			continue;
+		bDir = (pEnt->d_type == DT_DIR);
+		if (pEnt->d_type == DT_UNKNOWN && lstat(szPath, &st) == 0) // some filesystems don't fill in d_type
+			bDir = S_ISDIR(st.st_mode);
+		iLen = (int)strlen(pEnt->d_name);
+		if (bDir) // symbolic links to directories aren't followed
+			AddDirectory(szPath);
+		else if (iLen > 4 && strcasecmp(&pEnt->d_name[iLen-4], ".gif") == 0)
+			AddInput(szPath);
+	}
+	closedir(pDir);
+} /* AddDirectory() */
+//
+// Probe one file and format its JSON line; returns 0 if it's a readable GIF
+//
+static int ProbeFile(char *szName, char *szOut, int iLen)
+{
+PIL_FILE pf;
+PIL_GIF_INFO info;
 void *pFile;
+char *szErr;
+int n;
+
+	n = sprintf(szOut, "{\"file\":");
+	JSONString(&szOut[n], szName, iLen - 64 - n);
+	n += (int)strlen(&szOut[n]);
+	szErr = NULL;
+	memset(&pf, 0, sizeof(pf));
+	pFile = PILIOOpenRO(szName);
+	if (pFile == (void *)-1)
+		szErr = "can't open";
+	else
+	{
+		// map it so only the pages of the file the scan touches are read
+		pf.cFileType = PIL_FILE_GIF;
+		pf.iFileSize = PILIOSize(pFile);
+		pf.cState = PIL_FILE_STATE_LOADED;
+		pf.pData = PILIOMap(pFile, pf.iFileSize);
+		PILIOClose(pFile);
+		if (pf.pData == NULL)
+			szErr = "can't read";
+		else
+		{
+			pf.bMapped = 1;
+			if (pf.iFileSize < 13 || memcmp(pf.pData, "GIF8", 4) != 0)
+				szErr = "not a GIF";
+			else if (PILProbeGIF(&pf, &info) != 0)
+				szErr = "bad GIF";
+		}
+		PILClose(&pf);
+	}
+	if (szErr)
+		sprintf(&szOut[n], ",\"error\":\"%s\"}\n", szErr);
+	else
+		snprintf(&szOut[n], iLen - n, ",\"width\":%d,\"height\":%d,\"frames\":%d,\"duration_ms\":%d,\"loop\":%d,"
+			"\"global_colors\":%d,\"local_palettes\":%d,\"max_local_colors\":%d}\n",
+			info.iWidth, info.iHeight, info.iFrames, info.iDuration, info.iLoopCount,
+			info.iGlobalColors, info.iLocalPalettes, info.iMaxLocalColors);
+	return (szErr) ? -1 : 0;
+} /* ProbeFile() */
+//
+// --scan worker: probe files from the list until it runs out
+//
+static void * ScanThread(void *pArg)
+{
+char szLine[8192+256];
+int i;
+
+	while ((i = __sync_fetch_and_add(&iScanNext, 1)) < iInCount)
+	{
+		if (ProbeFile(pInList[i], szLine, sizeof(szLine)) != 0)
+			*(int *)pArg = -1;
+		fputs(szLine, stdout); // one call per line so lines from different threads don't mix
+	}
+	return NULL;
+} /* ScanThread() */
+//
+// --scan: report on every input instead of playing it
+//
+static int ScanFiles(void)
+{
+char **pNames;
+struct stat st;
+pthread_t *pThreads;
+int i, iCount, rc;
+
+	// Replace the directories in the list by the GIF files under them
+	pNames = pInList;
+	iCount = iInCount;
+	pInList = NULL;
+	iInCount = iInMax = 0;
+	for (i=0; i<iCount; i++)
+	{
+		if (stat(pNames[i], &st) == 0 && S_ISDIR(st.st_mode))
+			AddDirectory(pNames[i]);
+		else
+			AddInput(pNames[i]);
+		free(pNames[i]);
+	}
+	PILIOFree(pNames);
+	if (iThreads <= 0)
+		iThreads = PILIONumProcessors();
+	if (iThreads > iInCount)
+		iThreads = (iInCount > 0) ? iInCount : 1;
+	pThreads = PILIOAlloc(iThreads * sizeof(pthread_t));
+	rc = 0;
+	for (i=0; i<iThreads; i++)
+	{
+		if (pthread_create(&pThreads[i], NULL, ScanThread, &rc) != 0)
+			break;
+	}
+	iCount = i;
+	if (iCount == 0) // no threads at all, do it here
+		ScanThread(&rc);
+	for (i=0; i<iCount; i++)
+		pthread_join(pThreads[i], NULL);
+	PILIOFree(pThreads);
+	return rc;
+} /* ScanFiles() */
+
+int main( int argc, char *argv[ ], char *envp[ ] )
+{
+GP_GIF gifs[2], *pGIF, *pNext;
+int rc, iNext;
+char szTemp[32];
+char *szName;
 
    if (argc < 2)
       {
@@ -202,27 +812,8 @@ void *pFile;
       return 0;
       }
    parse_opts(argc, argv);
-	pFile = PILIOOpenRO(szIn);
-	if (pFile != (void *)-1)
-	{
-		// read the file entirely into memory
-		i = (int)PILIOSize(pFile);
-		memset(&pf, 0, sizeof(pf));
-		pf.iFileSize = i;
-		pf.pData = PILIOAlloc(i);
-		pf.cState = PIL_FILE_STATE_LOADED;
-		//pf.cState = PIL_FILE_STATE_OPEN;
-		pf.cFileType = PIL_FILE_GIF;
-		pf.iFile = pFile;
-		PILIORead(pFile, pf.pData, i);
-		PILIOClose(pFile);
-		if (memcmp(pf.pData,"GIF89",5) != 0) // not a GIF
-		{
-			printf("Not a GIF file\n");
-			PILIOFree(pf.pData);
-			return -1;
-		}
-		PILCountGIFPages(&pf);
+   if (bScan)
+      return ScanFiles();
    if (bLCD)
    {
 // LCD type, flip 180, SPI channel, D/C, RST, LCD
@@ -230,7 +821,6 @@ void *pFile;
    if (rc != 0)
    {
 	   printf("Error initializing LCD\n");
-	   PILClose(&pf);
 	   return -1;
    }
 //   spilcdSetOrientation(LCD_ORIENTATION_ROTATED);
@@ -283,67 +873,39 @@ printf("smem_len=%08x, line_length=%08x, mem can hold %d lines\n", finfo.smem_le
     }
    } // !LCD
 
-		// Read each frame one at a time
-		memset(&pp2, 0, sizeof(pp2));
-		pp2.iWidth = pf.iX;
-		pp2.iHeight = pf.iY;
-		if (bLCD)
-			pp2.cBitsperpixel = 16;
-		else
-			pp2.cBitsperpixel = vinfo.bits_per_pixel; // has to be same as display
-		pp2.iPitch = (pp2.iWidth * pp2.cBitsperpixel)/8;
-		pp2.pData = PILIOAlloc(pp2.iPitch * pp2.iHeight);
-		pp2.iDataSize = pp2.iPitch * pp2.iHeight;
-		pp2.cFlags = PIL_PAGEFLAGS_TOPDOWN;
-		pp2.cCompression = PIL_COMP_NONE;
-		pp2.pPalette = PILIOAlloc(2048);
-		for (iLoop=0; iLoop<iLoopCount; iLoop++)
-		{
-		for (i=0; i<pf.iPageTotal; i++)
+	// Two slots take turns: one plays while the next file of the playlist
+	// is opened and its first frame drawn in the other
+	memset(gifs, 0, sizeof(gifs));
+	pGIF = &gifs[0];
+	pGIF->iErr = -1;
+	rc = 0;
+	iNext = 0;
+	while (pGIF->iErr < 0 && iNext < iInCount)
+	{
+		pGIF->szNext = pInList[iNext++];
+		PrepareGIF(pGIF);
+		if (pGIF->iErr < 0)
+			rc = -1;
+	}
+	while (pGIF->iErr >= 0)
+	{
+		pNext = (pGIF == &gifs[0]) ? &gifs[1] : &gifs[0];
+		pNext->szNext = szName = (iNext < iInCount) ? pInList[iNext++] : NULL;
+		pNext->iErr = -1;
+		if (PlayGIF(pGIF, pNext) != 0)
+			rc = -1;
+		if (szName && pNext->iErr < 0)
+			rc = -1;
+		while (pNext->iErr < 0 && iNext < iInCount) // couldn't open that one, try the one after it
 		{
-		PIL_PAGE ppSrc;
-
-			iTime = MilliTime(); // get the current time in milliseconds
-//			printf("About to call PILReadGIF\n");
-	                err = PILReadGIF(&pp1, &pf, i);
-        	        if (err)
-                	{       
-                        	printf("PILReadGIF returned %d, datasize=%d\n", err, pp1.iDataSize);
-                        	return -1;
-                	}
-
-			memset(&ppSrc, 0, sizeof(ppSrc));
-			ppSrc.cCompression = PIL_COMP_NONE;
-			err = PILDecodeLZW(&pp1, &ppSrc, 1, 0);
-			if (err)
-			{
-				printf("PILDecodeLZW returned %d\n", err);
-				return -1;
-			}
-			if (i == 0) // get global color table from first frame
-			{
-				memcpy(pp2.pPalette, ppSrc.pPalette, 768);
-			}
-//			printf("About to call PILAnimateGIF, framedelay = %d\n", pp2.iFrameDelay);
-			err = PILAnimateGIF(&pp2, &ppSrc);
-//			printf("returned from PILAnimateGIF\n");
-			PILFree(&ppSrc);
-			PILFree(&pp1);
-			if (err == 0)
-			{
-				ShowFrame(&pp2);
-				iTime = MilliTime() - iTime; // number of milliseconds that have passed so far for this frame
-				iTime = pp1.iFrameDelay - iTime; // any time left for the frame delay?
-				if (iTime > 0)
-					usleep(iTime * 1000); // frame delay in ms (accounting for time spent decoding + displaying)
-			}
-			else
-			{
-				printf("Frame: %d, PILAnimate returned %d\n", i, err);
-			}
-		} // for each frame
-		} // for each loop over the animation
-		PILClose(&pf);
-	} // if file loaded successfully
-   return 0;
+			pNext->szNext = pInList[iNext++];
+			PrepareGIF(pNext);
+			if (pNext->iErr < 0)
+				rc = -1;
+		}
+		pGIF = pNext;
+	}
+	CloseGIF(&gifs[0]);
+	CloseGIF(&gifs[1]);
+	return rc;
 }
@@ -49,6 +49,12 @@ int PILClose(PIL_FILE *pFile)
       pFile->pJPEG = NULL;
       }
 #endif
+   if (pFile->bMapped)
+      {
+      PILIOUnmap(pFile->pData, pFile->iFileSize);
+      pFile->pData = NULL;
+      pFile->bMapped = FALSE;
+      }
    if (pFile->pSoundList)
       {
       PILIOFree(pFile->pSoundList);
@@ -69,6 +75,29 @@ int PILClose(PIL_FILE *pFile)
       PILIOFree(pFile->pPageList);
       pFile->pPageList = NULL;
       }
+   if (pFile->pGIFWindow)
+      {
+      PILIOFree(pFile->pGIFWindow->pBuf);
+      PILIOFree(pFile->pGIFWindow);
+      pFile->pGIFWindow = NULL;
+      }
+   if (pFile->pGIFPalettes)
+      {
+      PILIOFree(pFile->pGIFPalettes);
+      pFile->pGIFPalettes = NULL;
+      }
+   if (pFile->pGIFScan) // page scan stopped part way
+      {
+      if (pFile->cState != PIL_FILE_STATE_LOADED)
+         PILIOFree(pFile->pGIFScan->cBuf);
+      PILIOFree(pFile->pGIFScan);
+      pFile->pGIFScan = NULL;
+      }
+   if (pFile->pGIFFrames)
+      {
+      PILIOFree(pFile->pGIFFrames);
+      pFile->pGIFFrames = NULL;
+      }
    if (pFile->pPageLens)
       {
       PILIOFree(pFile->pPageLens);
@@ -416,14 +445,14 @@ int lsize;
       }
 } /* PILTIFFHoriz() */
 
-int PILReadAtOffset(PIL_FILE *pf, int iOffset, unsigned char *pDest, int iLen)
+int PILReadAtOffset(PIL_FILE *pf, PILOffset iOffset, unsigned char *pDest, int iLen)
 {
 	int iDataRead = 0;
 
-	if ((unsigned int)iOffset > (unsigned int)pf->iFileSize || iOffset < 0 || pDest == NULL) // trying to read past the end of the file or into a null pointer
+	if (iOffset > pf->iFileSize || iOffset < 0 || pDest == NULL) // trying to read past the end of the file or into a null pointer
 		return 0;
 	if (iOffset + iLen > pf->iFileSize)
-		iLen = pf->iFileSize - iOffset;
+		iLen = (int)(pf->iFileSize - iOffset);
 
 	if (pf->cState == PIL_FILE_STATE_LOADED) // we have everything in memory
 	{
@@ -432,7 +461,7 @@ int PILReadAtOffset(PIL_FILE *pf, int iOffset, unsigned char *pDest, int iLen)
 	}
 	else // need to read it from the file
 	{
-		PILIOSeek(pf->iFile, (PILOffset) iOffset, 0);
+		PILIOSeek(pf->iFile, iOffset, 0);
 		iDataRead = PILIORead(pf->iFile, pDest, iLen);
 	}
 	return iDataRead;
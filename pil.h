@@ -113,6 +113,7 @@ typedef unsigned __int64 uint64_t;
 // Needs to be #included prior to any other PIL #includes to avoid lack of
 // macro expansion problems
 #include "pil_io.h"
+#include <stdint.h>
 
 // #defined if audio decoding capability is desired
 //#define	PIL_AUDIO_INCLUDED
@@ -302,6 +303,7 @@ PIL_FILE_STATE_LOADED,				// image data is loaded into pData of PIL_FILE
 #define PIL_CONVERT_SKIPEXIF      0x00040000   // don't bother reading EXIF info even if it's there
 #define PIL_CONVERT_FOR_PDF       0x00080000   // the output will go to a PDF file, therefore will not have a palette, fix colors as needed
 #define PIL_CONVERT_MULTITHREAD   0x00100000   // use multiple threads to encode/decode
+#define PIL_CONVERT_8BPP          0x00800000   // GIF: output 1 byte per pixel even for 2-16 color images
 
 #define PIL_READFLAGS_LOADALL     0x00200000   // load entire image into memory
 #define PIL_READFLAGS_READMETA    0x00400000   // Read and collect unrecognized metadata
@@ -690,17 +692,28 @@ typedef struct pil_jpeg_slice
 } JPEG_SLICE;
 
 /* Structure which holds a page of graphics data */
+typedef struct tagpilrect
+{
+	uint32_t Left;
+	uint32_t Top;
+	uint32_t Right;
+	uint32_t Bottom;
+} PILRECT;
+
 typedef struct _pilpage {
 int iSize;        // size of the PIL_PAGE structure for version checking
 int iWidth, iHeight; // page size in pixels
 int iLinesDecoded; // number of scanlines successfully decoded when there is an error
 unsigned char *pData;		// pointer to image data
 int iPitch;       // The stride of a row
-int iOffset;		// offset to start of image data
+PILOffset iOffset;	// offset to start of image data
 int iXres, iYres;	// Resolution in dots per inch
 int iDataSize;		// Size of the data
 int iX, iY;       // offsets to handle GIF properly
 int iCX, iCY;     // used for GIF animation
+int iViewX, iViewY, iViewCX, iViewCY; // GIF animation: visible part of the page (iViewCX = 0 means all of it)
+int iDirtyCount;  // GIF animation: number of rectangles in rDirty
+PILRECT rDirty[2]; // GIF animation: visible pixels the last frame changed (disposal + new frame, Right/Bottom exclusive)
 int iFrameDelay;  // display delay in milliseconds and EXIF subIFD offset
 int iRepeatCount; // GIF animation repeat count (NETSCAPE app extension value)
 void *lUser;      // user defined
@@ -711,6 +724,7 @@ int iBackground;  // background color index or RGB888 value (for APNG)
 int iPageWidth, iPageHeight; // GIF page size & JPEG EXIF true size
 unsigned char *pPalette;	// pointer to color palette for 1, 4 & 8 bpp images
 unsigned char *pLocalPalette; // GIF images can have both a global and local color table for a single frame
+struct pil_gif_palette *pGIFPalette; // GIF frame's color table in the file's palette cache (not owned by the page; pLocalPalette isn't filled in when this is set)
 // Strip info
 int  iStripCount;          // Number of strips in the page
 uint32_t *plStrips;            // Pointer to strip offsets
@@ -776,6 +790,8 @@ char cState;				   // current state of this page
 char cSpecial;             // special flag indicating if it is a video or has an audio note
 unsigned char cGIFBits; // GIF packed fields
 unsigned char cBackground; // GIF background color
+unsigned char cGIFMap;     // GIF image descriptor packed fields (local color table, interlace)
+unsigned char cGIFFormat;  // GIF animation: pixel format of the page (PIL_GIF_FORMAT_xxx)
 unsigned char cJPEGSubSample; // TIFF type 6 stores this info outside of the data block
 unsigned char cJPEGMode; // 0xc0 = baseline, 0xc1 = extended, 0xc2 = progressive, 0xc3 = lossless
 // Variables for managing a dynamically growing buffer (e.g. for encoding)
@@ -791,14 +807,6 @@ typedef struct tagPILRGBQUAD {
   unsigned char rgbReserved;
 } PILRGBQUAD;
 
-typedef struct tagpilrect
-{
-	uint32_t Left;
-	uint32_t Top;
-	uint32_t Right;
-	uint32_t Bottom;
-} PILRECT;
-
 #define PIL_LF_FACESIZE 32
 typedef struct tagPILLOGFONT {
   signed long  lfHeight;
@@ -961,14 +969,20 @@ typedef struct _pilfile {
 	int iSize;                 // size of the PIL_FILE structure for version checking
 	void *  lUser;            // user defined
 	void *	iFile;	   		// file handle
-	int      iFileSize;        // size of source file
+	PILOffset iFileSize;       // size of source file
 	unsigned char *pData;		// pointer to memory mapped file
+	int bMapped;               // pData comes from PILIOMap (PILClose unmaps it)
 	int *pPageList;				// list of page offsets (e.g. for TIFF performance)
 	int *pSoundList;           // list of sound chunk offsets (video and audio)
 	int *pPageLens;            // Length of each page
 	int *pSoundLens;           // Length of each sound chunk
 	unsigned char *pKeyFlags;  // flags indicating key frames of video
    JPEGDATA *pJPEG;           // Precalc'd tables for JPEG + video files
+   struct pil_gif_lzw *pGIFLZW; // GIF decoder context from PILGIFLZWCreate (owned by the caller, can be shared)
+   struct pil_gif_frame *pGIFFrames; // GIF page list and frame table built by PILScanGIFPages (one entry per page)
+   struct pil_gif_scan *pGIFScan; // where PILScanGIFPages stopped (NULL once the whole file is scanned)
+   struct pil_gif_window *pGIFWindow; // streaming: the part of an open GIF file being played (PILGIFSetWindow)
+   struct pil_gif_palettes *pGIFPalettes; // GIF color tables used so far, with their 16/32-bit versions
 	int iPage, iPageTotal;		// current page and total pages
 	int iSoundTotal;           // number of sound chunks
 	int iSampleFreq;           // sound sample frequency
@@ -1005,6 +1019,160 @@ typedef struct _pilfile {
     int iAnnotationOffset;
 } PIL_FILE;
 
+#define PIL_GIF_MAXCODE 4096
+// What PILReadGIF() needs to know about a GIF frame, gathered by the one pass
+// of PILScanGIFPages() so later reads don't have to parse the headers again
+typedef struct pil_gif_frame
+{
+PILOffset iOffset;         // file offset where the page starts (its extension blocks)
+uint32_t u32Palette;       // from iOffset to just past the image descriptor (local color table if any)
+uint32_t u32Data;          // from iOffset to the LZW code size byte
+int iFrameDelay;           // delay in ms as PILReadGIF() reports it (0 = no graphic control extension)
+unsigned short usX, usY, usWidth, usHeight; // frame position and size
+unsigned char ucGIFBits;   // graphic control packed fields (disposal method, transparency flag)
+unsigned char ucTransparent; // transparent color index
+unsigned char ucMap;       // image descriptor flags (local color table, interlace, table size)
+} PIL_GIF_FRAME;
+
+// Progress of a GIF page scan that hasn't reached the end of the file yet
+typedef struct pil_gif_scan
+{
+unsigned char *cBuf;       // file data (the whole file when loaded, otherwise a window of it)
+PILOffset lFileOff;        // file offset of cBuf[0]
+PILOffset iOff;            // where the next page starts in cBuf
+int iNumPages;             // pages started (the last one isn't scanned yet)
+int iFrameMax;             // entries allocated in pGIFFrames
+PILOffset iDataAvailable;  // valid bytes in cBuf
+PILOffset iDataRemaining;  // bytes of the file from lFileOff on
+int iBufferSize;           // size of cBuf when it's a window
+} PIL_GIF_SCAN;
+
+// Bytes of a GIF file that isn't loaded, read by PILReadGIF() as frames are
+// requested; the page being decoded plus read-ahead for the ones after it
+typedef struct pil_gif_window
+{
+unsigned char *pBuf;       // file data from iStart on
+PILOffset iStart;          // file offset of pBuf[0]
+int iLen;                  // valid bytes in pBuf
+int iSize;                 // allocated size (grows to fit the largest frame)
+} PIL_GIF_WINDOW;
+
+// A GIF color table as PILReadGIF() found it, plus the RGB565 and ARGB
+// versions PILAnimateGIFStart() needs, each made the first time it's used
+#define PIL_GIF_PALETTE_SLOTS 8 // slot 0 is the global color table, the rest local ones
+typedef struct pil_gif_palette
+{
+PILOffset iOffset;         // file offset of the color table (0 = slot unused)
+unsigned char ucRGB[768];  // in PILFixGIFRGB() order, unused entries black
+unsigned char bHave16, bHave32; // us565 / ul32 are filled in
+unsigned char cFormat16;   // PIL_GIF_FORMAT_xxx us565 was made for (little or big endian)
+unsigned char bHave8, bHave24; // uc332 / uc666 are filled in
+unsigned short us565[256];
+uint32_t ul32[256];
+unsigned char uc332[256];
+unsigned char uc666[768];
+} PIL_GIF_PALETTE;
+
+typedef struct pil_gif_palettes
+{
+int iNext;                 // slot a new local color table replaces (round robin over 1..7)
+PIL_GIF_PALETTE pal[PIL_GIF_PALETTE_SLOTS];
+} PIL_GIF_PALETTES;
+
+// What PILProbeGIF() reports about a GIF without decoding any image data
+typedef struct pil_gif_info
+{
+int iWidth, iHeight;       // logical screen size
+int iFrames;
+int iDuration;             // total of the frame delays in ms, as PILReadGIF() reports them
+int iLoopCount;            // NETSCAPE2.0 repeat count (0 = forever), -1 if there isn't one
+int iGlobalColors;         // size of the global color table (0 = none)
+int iLocalPalettes;        // frames with their own color table
+int iMaxLocalColors;       // size of the largest local color table (0 = none)
+} PIL_GIF_INFO;
+
+// Called with each finished row of a GIF frame (1 byte per pixel); y is the
+// row's final position within the frame, also for interlaced images
+typedef void (*PILGIFROW)(void *pUser, int y, unsigned char *pRow, int iWidth);
+// Row compositing kernel: 8-bit indices -> RGB565 or ARGB pixels, skipping iTransparent (-1 = none)
+typedef void (*PILGIFCOMPOSE)(void *pDest, unsigned char *pSrc, int iCount, void *pPalette, int iTransparent);
+// Resumable GIF LZW decoder state. The sub-blocks of a frame are pushed in as
+// they arrive and each push decodes as far as the data allows. Output is 1 byte
+// per pixel with no row padding, so iOffset is also the current x + y*width.
+// In row mode (pRow != NULL) the frame is built one row at a time, either in a
+// single reused row or in place at each row's final position; the string
+// table holds prefix/first/suffix links in u32Offsets instead of output offsets.
+typedef struct pil_gif_lzw
+{
+uint64_t ulBits;           // bit accumulator (LSB first)
+int iBitCount;             // number of valid bits in ulBits
+int iOffset;               // next output pixel
+int iSize;                 // total pixels in the frame
+int iOldOffset, iOldLen;   // where the previous code's string was written
+unsigned char *pOut;       // output pixels; also used as the string table
+unsigned short codestart, codesize, nextcode, nextlim;
+unsigned short cc, eoi, sMask, oldcode;
+PILBOOL bDone;             // EOI seen, frame complete or corrupt data
+PILBOOL bSubBlocks;        // data is pushed as the file's length-prefixed sub-blocks
+int iBlockLeft;            // sub-block mode: bytes of the current sub-block still to come
+PILGIFROW pfnRow;          // row mode: called as each row is finished (optional)
+void *pUser;               // passed to pfnRow
+unsigned char *pRow;       // row mode: the row being built (iWidth bytes)
+unsigned char *pFrame;     // row mode: top of the frame when rows are written in place
+int iPitch;                // row mode: bytes per row of pFrame (0 = reuse pRow)
+int iWidth, iHeight;       // row mode: frame size
+int iX, iY;                // row mode: current position (iY is the destination row)
+int iRowCount;             // row mode: rows finished so far
+int iPass;                 // row mode: interlace pass (-1 = not interlaced)
+int iVisX0, iVisX1, iVisY0, iVisY1; // row mode: visible part of the frame
+int iRowX0, iRowX1;        // row mode: visible columns of the current row (empty if hidden)
+int (*pfnPush)(struct pil_gif_lzw *pLZW, unsigned char *pData, int iLen); // decoder picked for the frame
+void *pCanvasPalette;      // canvas mode: RGB565 or ARGB colors for each index
+int iTransparent;          // canvas mode: index to leave untouched or -1
+unsigned char ucStack[PIL_GIF_MAXCODE]; // row mode: unwinds strings that cross rows
+unsigned char *pScratch;   // work buffer kept between frames (4-bpp unpacked pixels, row)
+int iScratchSize;          // size of pScratch in bytes
+uint32_t u32Offsets[PIL_GIF_MAXCODE]; // output offset of each code's string
+uint32_t u32Lengths[PIL_GIF_MAXCODE]; // length of each code's string
+uint32_t u32Pos[PIL_GIF_MAXCODE]; // row mode: byte offset from pFrame of each code's string
+} PIL_GIF_LZW;
+
+// Pixel formats of a GIF animation page (PIL_PAGE.cGIFFormat). The palette is
+// converted once per frame, so the page is drawn directly in the format a
+// display wants on the wire.
+#define PIL_GIF_FORMAT_NATIVE     0 // RGB565 little endian, BGR888 or ARGB8888 for 16/24/32bpp
+#define PIL_GIF_FORMAT_RGB565_BE  1 // 16bpp: RGB565 big endian (byte swapped)
+#define PIL_GIF_FORMAT_RGB666     2 // 24bpp: R, G, B bytes with the color in the upper 6 bits
+#define PIL_GIF_FORMAT_RGB332     3 // 8bpp: RRRGGGBB
+
+// Pixels under a frame with disposal method 3, kept in the animation page's
+// lUser (a single block, so PILFree() releases it) until they're put back
+typedef struct pil_gif_save
+{
+int iSize;                 // bytes of pixel data the block has room for
+int x0, y0, x1, y1;        // area saved (page coordinates, x1/y1 exclusive)
+// followed by the pixels, (x1-x0) * bytes per pixel per row
+} PIL_GIF_SAVE;
+
+// State for drawing a GIF frame onto the animation page one row at a time
+typedef struct pil_gif_anim
+{
+PIL_PAGE *pDestPage;       // animation page (16/24/32bpp)
+PIL_PAGE *pSrcPage;        // frame position, size, transparency and local palette
+unsigned char *pPalette;   // RGB colors (RGB666 ones on such a page) for 24bpp
+unsigned short *pusPalette;
+uint32_t *pulPalette;
+unsigned char *pucPalette; // RGB332 colors for an 8bpp page
+int iTransparent;          // transparent color index or -1
+int iSrcBpp;               // format of the rows passed to PILAnimateGIFLine (4 or 8)
+int iVisX0, iVisX1;        // visible columns of the frame (frame coordinates)
+int iVisY0, iVisY1;        // visible rows of the frame
+PILGIFCOMPOSE pfnCompose;  // 16/32bpp row kernel picked for this CPU (NULL for 24bpp)
+int iBoundX0, iBoundY0, iBoundX1, iBoundY1; // page pixels PILAnimateGIFLine() drew (x1/y1 exclusive)
+int bBounds;               // the rows went through PILAnimateGIFLine(), so the bounds are exact
+unsigned char ucPalette[2048]; // RGB palette; converted 16/32-bit version at +1024
+} PIL_GIF_ANIM;
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -1026,6 +1194,26 @@ int PILResize(PIL_PAGE *pInPage, PIL_PAGE *pOutPage, int iNewX, int iNewY);
 int PILCrop(PIL_PAGE *pPage, PIL_VIEW *pView);
 int PILModify(PIL_PAGE *pPage, pilmodifyops iOperation, int iParam1, int iParam2);
 int PILAnimateGIF(PIL_PAGE *pPage, PIL_PAGE *pAnimatePage);
+int PILAnimateGIFStart(PIL_PAGE *pPage, PIL_PAGE *pAnimatePage, PIL_GIF_ANIM *pAnim);
+void PILAnimateGIFLine(void *pAnim, int y, unsigned char *pRow, int iWidth);
+void PILAnimateGIFEnd(PIL_GIF_ANIM *pAnim);
+int PILDecodeGIF(PIL_FILE *pFile, PIL_PAGE *pInPage, PIL_PAGE *pOutPage, int iOptions);
+int PILDecodeGIFRows(PIL_FILE *pFile, PIL_PAGE *pInPage, PILGIFROW pfnRow, void *pUser, int iOptions);
+int PILDecodeGIFCanvas(PIL_FILE *pFile, PIL_PAGE *pInPage, PIL_PAGE *pDestPage, int iOptions);
+int PILScanGIFPages(PIL_FILE *pFile, int iPages);
+int PILGIFSetWindow(PIL_FILE *pFile, int iSize);
+int PILProbeGIF(PIL_FILE *pFile, PIL_GIF_INFO *pInfo);
+int PILReadGIFIndex(PIL_FILE *pFile, TCHAR *szName, uint32_t u32Stamp);
+int PILWriteGIFIndex(PIL_FILE *pFile, TCHAR *szName, uint32_t u32Stamp);
+PIL_GIF_LZW * PILGIFLZWCreate(void);
+void PILGIFLZWDestroy(PIL_GIF_LZW *pLZW);
+unsigned char * PILGIFLZWScratch(PIL_GIF_LZW *pLZW, int iSize);
+int PILGIFLZWInit(PIL_GIF_LZW *pLZW, int iCodeStart, unsigned char *pOut, int iSize);
+int PILGIFLZWInitRows(PIL_GIF_LZW *pLZW, int iCodeStart, int iWidth, int iHeight, PILBOOL bInterlaced, unsigned char *pRow, int iPitch, PILGIFROW pfnRow, void *pUser);
+int PILGIFLZWInitCanvas(PIL_GIF_LZW *pLZW, int iCodeStart, int iWidth, int iHeight, PILBOOL bInterlaced, unsigned char *pCanvas, int iPitch, int iBpp, void *pPalette, int iTransparent);
+void PILGIFLZWSetView(PIL_GIF_LZW *pLZW, int x0, int y0, int x1, int y1);
+int PILGIFLZWPush(PIL_GIF_LZW *pLZW, unsigned char *pData, int iLen);
+int PILGIFLZWPushBlocks(PIL_GIF_LZW *pLZW, unsigned char *pData, int iLen);
 int PILAnimatePNG(PIL_PAGE *pPage, PIL_PAGE *pAnimatePage);
 int PILRotateJPEG(TCHAR *szSource, TCHAR *szDest, int iAngle);
 int PILScanJPEG(JPEG_SCAN **pScanList, BUFFERED_BITS *bb, JPEGDATA *pJPEG);
@@ -32,6 +32,7 @@
  *            PILIORead - Read a block of data from a file                  *
  *            PILIOWrite - write a block of data to a file                  *
  *            PILIOSeek - Seek to a specific section in a file              *
+ *            PILIOMap - Map a file into memory (read-only)                 *
  *            PILIODate - Provide date and time in TIFF 6.0 format          *
  *            PILIOAlloc - Allocate a block of memory                       *
  *            PILIOFree - Free a block of memory                            *
@@ -43,6 +44,7 @@
  *            5/26/2012 added 16-byte alignment to alloc/free functions     *
  ****************************************************************************/
 //#include "my_windows.h"
+#define _FILE_OFFSET_BITS 64 // 64-bit fseeko/ftello offsets on 32-bit systems too
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdint.h>
@@ -60,6 +62,7 @@
 #ifndef WIN32
 #include <unistd.h>
 #include <pthread.h>
+#include <sys/mman.h>
 #endif // WIN32
 
 #include "pil.h"
@@ -245,7 +248,7 @@ int PILIORename(TCHAR *szSrc, TCHAR *szDest)
 //      return 0;
 //   else
 //      return -1;
-   return -1;
+   return rename((char *)szSrc, (char *)szDest);
 } /* PILIORename() */
 
 /****************************************************************************
@@ -355,15 +358,15 @@ void *ohandle;
 
 } /* PILIOCreate() */
 
-unsigned long PILIOSize(void *iHandle)
+PILOffset PILIOSize(void *iHandle)
 {
-unsigned long ulSize;
-unsigned long ulStart;
+PILOffset ulSize;
+PILOffset ulStart;
 
-    ulStart = ftell((FILE *)iHandle);
-	fseek((FILE *)iHandle, 0L, SEEK_END);
-	ulSize = ftell((FILE *)iHandle);
-	fseek((FILE *)iHandle, ulStart, SEEK_SET);
+    ulStart = ftello((FILE *)iHandle);
+	fseeko((FILE *)iHandle, 0, SEEK_END);
+	ulSize = ftello((FILE *)iHandle);
+	fseeko((FILE *)iHandle, ulStart, SEEK_SET);
 //    ulSize = PILIOSeek(iHandle, 0, 2); // set to end to see the length
 //    PILIOSeek(iHandle, 0, 0); // reset to start
     return ulSize;
@@ -372,7 +375,7 @@ unsigned long ulStart;
 
 /****************************************************************************
  *                                                                          *
- *  FUNCTION   : PILIOSeek(int, signed long, int)                           *
+ *  FUNCTION   : PILIOSeek(int, PILOffset, int)                             *
  *                                                                          *
  *  PURPOSE    : Seeks within an open file                                  *
  *                                                                          *
@@ -383,19 +386,19 @@ unsigned long ulStart;
  *  RETURNS    : New offset within file.                                    *
  *                                                                          *
  ****************************************************************************/
-unsigned long PILIOSeek(void * iHandle, unsigned long lOffset, int iMethod)
+PILOffset PILIOSeek(void * iHandle, PILOffset lOffset, int iMethod)
 {
 	   int iType;
-	   /*fpos_t*/ unsigned long ulNewPos;
+	   PILOffset ulNewPos;
 
 	   if (iMethod == 0) iType = SEEK_SET;
 	   else if (iMethod == 1) iType = SEEK_CUR;
 	   else iType = SEEK_END;
 
-	   fseek((FILE *)iHandle, lOffset, iType);
-	   ulNewPos = fgetpos((FILE *)iHandle, (fpos_t *)&ulNewPos);
+	   fseeko((FILE *)iHandle, lOffset, iType);
+	   ulNewPos = ftello((FILE *)iHandle);
 //       ulNewPos = MyNSSeek(iHandle, lOffset, iMethod);
-	   return (unsigned long)ulNewPos;
+	   return ulNewPos;
 
 } /* PILIOSeek() */
 
@@ -463,6 +466,91 @@ void PILIOClose(void * iHandle)
 
 } /* PILIOClose() */
 
+/****************************************************************************
+ *                                                                          *
+ *  FUNCTION   : PILIOMap(int, PILOffset)                                   *
+ *                                                                          *
+ *  PURPOSE    : Map an open file into memory, read-only                    *
+ *                                                                          *
+ *  PARAMETERS : File Handle                                                *
+ *               Number of bytes to map (from the start of the file)        *
+ *                                                                          *
+ *  RETURNS    : Pointer to the file data, NULL if it can't be mapped       *
+ *                                                                          *
+ ****************************************************************************/
+void * PILIOMap(void * iHandle, PILOffset iSize)
+{
+#ifndef WIN32
+void *p;
+
+	if (iSize <= 0 || (uint64_t)iSize > (uint64_t)SIZE_MAX)
+	   return NULL; // the caller reads the file instead
+	p = mmap(NULL, (size_t)iSize, PROT_READ, MAP_SHARED, fileno((FILE *)iHandle), 0);
+	if (p == MAP_FAILED)
+	   return NULL;
+	// the whole file gets parsed front to back first, let the kernel read ahead
+	madvise(p, (size_t)iSize, MADV_SEQUENTIAL);
+	return p;
+#else
+	return NULL;
+#endif // WIN32
+} /* PILIOMap() */
+
+/****************************************************************************
+ *                                                                          *
+ *  FUNCTION   : PILIOUnmap(void *, PILOffset)                              *
+ *                                                                          *
+ *  PURPOSE    : Release a file mapped with PILIOMap                        *
+ *                                                                          *
+ *  PARAMETERS : Pointer returned by PILIOMap                               *
+ *               Number of bytes mapped                                     *
+ *                                                                          *
+ *  RETURNS    : NOTHING                                                    *
+ *                                                                          *
+ ****************************************************************************/
+void PILIOUnmap(void * pMap, PILOffset iSize)
+{
+#ifndef WIN32
+	if (pMap != NULL)
+	   munmap(pMap, (size_t)iSize);
+#endif // WIN32
+} /* PILIOUnmap() */
+
+/****************************************************************************
+ *                                                                          *
+ *  FUNCTION   : PILIOAdvise(void *, PILOffset, PILOffset, int)             *
+ *                                                                          *
+ *  PURPOSE    : Tell the OS how part of a mapped file will be used         *
+ *                                                                          *
+ *  PARAMETERS : Pointer returned by PILIOMap                               *
+ *               Offset and length of the range                             *
+ *               PIL_IO_ADVISE_NORMAL / _SEQUENTIAL / _WILLNEED             *
+ *                                                                          *
+ *  RETURNS    : NOTHING                                                    *
+ *                                                                          *
+ ****************************************************************************/
+void PILIOAdvise(void * pMap, PILOffset iOffset, PILOffset iLen, int iAdvice)
+{
+#ifndef WIN32
+static uintptr_t ulPageMask = 0;
+uintptr_t ulStart;
+int iFlag;
+
+	if (pMap == NULL || iLen <= 0)
+	   return;
+	if (ulPageMask == 0)
+	   ulPageMask = (uintptr_t)sysconf(_SC_PAGESIZE) - 1;
+	if (iAdvice == PIL_IO_ADVISE_WILLNEED) iFlag = MADV_WILLNEED;
+	else if (iAdvice == PIL_IO_ADVISE_SEQUENTIAL) iFlag = MADV_SEQUENTIAL;
+	else iFlag = MADV_NORMAL;
+	// madvise() only takes whole pages
+	ulStart = (uintptr_t)pMap + (uintptr_t)iOffset;
+	iLen += (PILOffset)(ulStart & ulPageMask);
+	ulStart &= ~ulPageMask;
+	madvise((void *)ulStart, (size_t)iLen, iFlag); // only a hint, failure doesn't matter
+#endif // WIN32
+} /* PILIOAdvise() */
+
 /****************************************************************************
  *                                                                          *
  *  FUNCTION   : PILIOReAlloc(void *, unsigned long)                        *
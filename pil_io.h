@@ -32,8 +32,8 @@ extern "C" {
 // PILHALError Is a typedef that is equivalent to the native environment's
 // filesystem error code
 typedef void * PILHALError;
-typedef signed long PILOffset;
-//typedef signed long long int PILOffset;
+//typedef signed long PILOffset;
+typedef signed long long int PILOffset; // files can be larger than 2GB
 
 // OS independent date structure
 typedef struct pil_date_tag
@@ -46,22 +46,30 @@ typedef struct pil_date_tag
 	int iSecond;
 } PIL_DATE;
 
+// Access pattern hints for PILIOAdvise()
+#define PIL_IO_ADVISE_NORMAL     0
+#define PIL_IO_ADVISE_SEQUENTIAL 1
+#define PIL_IO_ADVISE_WILLNEED   2
+
 #ifndef TCHAR
 #define TCHAR char
 #endif
 
 extern PILBOOL PILIOExists(void *szName);
-extern unsigned long PILIOSize(void *iHandle);
+extern PILOffset PILIOSize(void *iHandle);
 extern int PILIOMsgBox(TCHAR *, TCHAR *);
 extern void * PILIOOpen(void *);
 extern void * PILIOOpenRO(void *);
 extern void * PILIOCreate(TCHAR *);
 extern int PILIODelete(TCHAR *);
 extern int PILIORename(TCHAR *, TCHAR *);
-extern unsigned long PILIOSeek(void *, unsigned long, int);
+extern PILOffset PILIOSeek(void *, PILOffset, int);
 extern signed int PILIORead(void *, void *, unsigned int);
 extern unsigned int PILIOWrite(void *, void *, unsigned int);
 extern void PILIOClose(void *);
+extern void * PILIOMap(void *, PILOffset);
+extern void PILIOUnmap(void *, PILOffset);
+extern void PILIOAdvise(void *, PILOffset, PILOffset, int);
 void * PILIOAlloc(unsigned long size);
 void * PILIOReAlloc(void *, unsigned long size);
 void * PILIOAllocNoClear(unsigned long size);
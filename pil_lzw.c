@@ -30,6 +30,12 @@
 #include <ctype.h>
 #include "pil.h"
 #include "pil_io.h"
+// x86 compositing kernels are built with per-function target attributes and
+// picked at run time, so no special compiler flags are needed
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && !defined(PIL_NO_SIMD)
+#define PIL_GIF_X86_SIMD
+#include <immintrin.h>
+#endif
 
 /* GIF Defines and variables */
 #define CTLINK 0
@@ -44,28 +50,238 @@ unsigned char cGIFPass[8] = {8,0,8,4,4,2,2,1}; // GIF interlaced y delta
 
 extern void PILFixGIFRGB(unsigned char *pPal);
 extern void PILTIFFHoriz(PIL_PAGE *InPage, PILBOOL bDecode);
-extern int PILReadAtOffset(PIL_FILE *pf, int iOffset, unsigned char *pDest, int iLen);
+extern int PILReadAtOffset(PIL_FILE *pf, PILOffset iOffset, unsigned char *pDest, int iLen);
 extern void PILFlushBits(BUFFERED_BITS *bb);
 extern void PILTIFFHoriz_SIMD(PIL_PAGE *InPage, PILBOOL bDecode);
 
+/****************************************************************************
+ *                                                                          *
+ *  FUNCTION   : PILGIFSetWindow()                                          *
+ *                                                                          *
+ *  PURPOSE    : Play a GIF file that isn't loaded through a window of      *
+ *               iSize bytes.                                               *
+ *                                                                          *
+ ****************************************************************************/
+//
+// For files too big to load: PILReadGIF() reads each requested page into the
+// window along with as much of what follows as fits, so memory use stays at
+// about iSize (or the largest frame, if that's bigger) whatever the file size.
+// The pages have to have been found with PILScanGIFPages() first.
+//
+int PILGIFSetWindow(PIL_FILE *pFile, int iSize)
+{
+PIL_GIF_WINDOW *pWin;
+
+	if (pFile->cState == PIL_FILE_STATE_LOADED || iSize < 1)
+		return PIL_ERROR_INVPARAM;
+	if (pFile->pGIFWindow) // already streaming
+		return 0;
+	pWin = (PIL_GIF_WINDOW *)PILIOAlloc(sizeof(PIL_GIF_WINDOW));
+	if (pWin == NULL)
+		return PIL_ERROR_MEMORY;
+	pWin->pBuf = (unsigned char *)PILIOAllocNoClear(iSize);
+	if (pWin->pBuf == NULL)
+	{
+		PILIOFree(pWin);
+		return PIL_ERROR_MEMORY;
+	}
+	pWin->iSize = iSize;
+	pFile->pGIFWindow = pWin;
+	return 0;
+} /* PILGIFSetWindow() */
+
+/****************************************************************************
+ *                                                                          *
+ *  FUNCTION   : PILGIFWindowFetch()                                        *
+ *                                                                          *
+ *  PURPOSE    : Make sure iLen bytes of the file at iStart are in the      *
+ *               streaming window.                                          *
+ *                                                                          *
+ ****************************************************************************/
+//
+// Pages are requested in order, so a page is usually already in the window
+// from the read-ahead of an earlier one. Otherwise the window is refilled
+// starting at the page: what it still holds of the page moves to the front
+// and only the rest is read.
+//
+static unsigned char * PILGIFWindowFetch(PIL_FILE *pFile, PILOffset iStart, int iLen)
+{
+PIL_GIF_WINDOW *pWin = pFile->pGIFWindow;
+unsigned char *pBuf;
+int iKeep, iRead;
+
+	if (iStart >= pWin->iStart && iStart + iLen <= pWin->iStart + pWin->iLen)
+		return &pWin->pBuf[iStart - pWin->iStart]; // already there
+	iKeep = 0;
+	if (iStart >= pWin->iStart && iStart < pWin->iStart + pWin->iLen)
+	{
+		iKeep = (int)(pWin->iStart + pWin->iLen - iStart);
+		memmove(pWin->pBuf, &pWin->pBuf[iStart - pWin->iStart], iKeep);
+	}
+	if (iLen > pWin->iSize) // frame is bigger than the window, grow it to fit
+	{
+		pBuf = (unsigned char *)PILIOReAlloc(pWin->pBuf, iLen);
+		if (pBuf == NULL)
+		{
+			pWin->iLen = 0;
+			return NULL;
+		}
+		pWin->pBuf = pBuf;
+		pWin->iSize = iLen;
+	}
+	iRead = pWin->iSize;
+	if (iStart + iRead > pFile->iFileSize)
+		iRead = (int)(pFile->iFileSize - iStart);
+	pWin->iStart = iStart;
+	pWin->iLen = iKeep + PILReadAtOffset(pFile, iStart + iKeep, &pWin->pBuf[iKeep], iRead - iKeep);
+	if (pWin->iLen < iLen) // short read
+		return NULL;
+	return pWin->pBuf;
+} /* PILGIFWindowFetch() */
+
+/****************************************************************************
+ *                                                                          *
+ *  FUNCTION   : PILGIFPageData()                                           *
+ *                                                                          *
+ *  PURPOSE    : Find the data of a page prepared by PILReadGIF().          *
+ *                                                                          *
+ ****************************************************************************/
+static unsigned char * PILGIFPageData(PIL_FILE *pFile, PIL_PAGE *pPage)
+{
+PIL_GIF_WINDOW *pWin = pFile->pGIFWindow;
+
+	if (pFile->cState == PIL_FILE_STATE_LOADED)
+		return (pFile->pData) ? &pFile->pData[pPage->iOffset] : NULL;
+	if (pWin) // in the streaming window, as long as no other page was read since
+	{
+		if (pPage->iOffset < pWin->iStart || pPage->iOffset + pPage->iDataSize > pWin->iStart + pWin->iLen)
+			return NULL;
+		return &pWin->pBuf[pPage->iOffset - pWin->iStart];
+	}
+	return (pPage->pData) ? &pPage->pData[pPage->iOffset] : NULL;
+} /* PILGIFPageData() */
+
+/****************************************************************************
+ *                                                                          *
+ *  FUNCTION   : PILGIFPrefetch()                                           *
+ *                                                                          *
+ *  PURPOSE    : Ask for the page after this one to be read into a mapped   *
+ *               file while the current one is being decoded.               *
+ *                                                                          *
+ ****************************************************************************/
+static void PILGIFPrefetch(PIL_FILE *pFile, int iPage)
+{
+PIL_GIF_FRAME *pFrame;
+PILOffset iEnd;
+
+	iPage++;
+	if (iPage >= pFile->iPageTotal)
+	{
+		// The scan reads the pages it hasn't found yet in order, after the
+		// last page a looping animation goes back to the first one
+		if (pFile->pGIFScan || iPage == 1)
+			return;
+		iPage = 0;
+	}
+	pFrame = &pFile->pGIFFrames[iPage];
+	if (iPage + 1 < pFile->iPageTotal || pFile->pGIFScan)
+		iEnd = pFrame[1].iOffset;
+	else
+		iEnd = pFile->iFileSize;
+	PILIOAdvise(pFile->pData, pFrame->iOffset, iEnd - pFrame->iOffset, PIL_IO_ADVISE_WILLNEED);
+} /* PILGIFPrefetch() */
+
+/****************************************************************************
+ *                                                                          *
+ *  FUNCTION   : PILGIFPalette()                                            *
+ *                                                                          *
+ *  PURPOSE    : Find a color table in the file's palette cache, adding it  *
+ *               if it isn't there yet.                                     *
+ *                                                                          *
+ ****************************************************************************/
+//
+// The tables are told apart by where they are in the file, so each one is
+// copied and byte-swapped once instead of for every frame that uses it.
+// Returns NULL when the file data doesn't stay put (the caller then copies
+// the table to the page as before) or there's no memory for the cache.
+//
+static PIL_GIF_PALETTE * PILGIFPalette(PIL_FILE *pFile, PILOffset iOffset, unsigned char *pSrc, int iColors, PILBOOL bGlobal)
+{
+PIL_GIF_PALETTES *pPals = pFile->pGIFPalettes;
+PIL_GIF_PALETTE *pPal;
+int i;
+
+	if (pFile->cState != PIL_FILE_STATE_LOADED && pFile->pGIFWindow == NULL)
+		return NULL;
+	if (pPals == NULL)
+	{
+		pPals = pFile->pGIFPalettes = (PIL_GIF_PALETTES *)PILIOAlloc(sizeof(PIL_GIF_PALETTES));
+		if (pPals == NULL)
+			return NULL;
+		pPals->iNext = 1;
+	}
+	for (i=0; i<PIL_GIF_PALETTE_SLOTS; i++)
+	{
+		if (pPals->pal[i].iOffset == iOffset)
+			return &pPals->pal[i];
+	}
+	if (bGlobal)
+		pPal = &pPals->pal[0];
+	else
+	{
+		pPal = &pPals->pal[pPals->iNext];
+		pPals->iNext = (pPals->iNext + 1 < PIL_GIF_PALETTE_SLOTS) ? pPals->iNext + 1 : 1;
+	}
+	memset(pPal->ucRGB, 0, sizeof(pPal->ucRGB));
+	memcpy(pPal->ucRGB, pSrc, iColors * 3);
+	PILFixGIFRGB(pPal->ucRGB); /* Fix RGB byte order */
+	pPal->bHave16 = pPal->bHave32 = pPal->bHave8 = pPal->bHave24 = 0;
+	pPal->iOffset = iOffset;
+	return pPal;
+} /* PILGIFPalette() */
+
+//
+// Fill in the header of page iRequestedPage. The frame's data stays in the
+// file (pPage->pData is not set), so decode it with PILDecodeGIF().
+//
 int PILReadGIF(PIL_PAGE *pPage, PIL_FILE *pFile, int iRequestedPage)
 {
 int iOffset, iErr, i, j, iMap;
-int iDataLen, codestart;
-unsigned char c, *d, *p, *pOldPage;
+int codestart;
+unsigned char c, *p;
+PIL_GIF_FRAME *pFrame;
+PILOffset iEnd;
 
 	iErr = 0;
+         pFrame = NULL;
+         pPage->pGIFPalette = NULL;
          pPage->iStripCount = 0; // no strips
+         pPage->cGIFBits = 0; // in case the page is reused and this frame has no graphic control extension
+         pPage->iTransparent = 0;
+         pPage->iFrameDelay = 0;
          iOffset = pPage->iOffset = 0;
-         if (pFile->iPageTotal > 1)
+         if (pFile->pGIFFrames) // pages found by PILScanGIFPages()
             {
-            if (pFile->cState == PIL_FILE_STATE_LOADED)
-            pPage->iOffset = pFile->pPageList[iRequestedPage];
-            pPage->iDataSize = pFile->pPageList[iRequestedPage+1] - pFile->pPageList[iRequestedPage];
+            if (iRequestedPage < 0 || iRequestedPage >= pFile->iPageTotal)
+               {
+               iErr = PIL_ERROR_PAGENF;
+               goto quit_gif;
+               }
+            pFrame = &pFile->pGIFFrames[iRequestedPage];
+            if (iRequestedPage + 1 < pFile->iPageTotal || pFile->pGIFScan) // the next page has been found
+               iEnd = pFrame[1].iOffset;
+            else
+               iEnd = pFile->iFileSize;
+            if (pFile->cState == PIL_FILE_STATE_LOADED || pFile->pGIFWindow)
+               pPage->iOffset = pFrame->iOffset;
+            iEnd -= pFrame->iOffset;
+            pPage->iDataSize = (iEnd > 0x7fffffff) ? 0x7fffffff : (int)iEnd;
+            if (iRequestedPage == 0) // still parsed for the header, palette and loop count
+               pFrame = NULL;
             }
          else
             {
-            pPage->iDataSize = pFile->iFileSize;
+            pPage->iDataSize = (pFile->iFileSize > 0x7fffffff) ? 0x7fffffff : (int)pFile->iFileSize;
             }
          if (pPage->iDataSize <= 0 || pPage->iOffset < 0 || pPage->iOffset > pFile->iFileSize)
             {
@@ -76,12 +292,22 @@ unsigned char c, *d, *p, *pOldPage;
          pPage->cCompression = PIL_COMP_GIF;
          pPage->cFlags = PIL_PAGEFLAGS_TOPDOWN;
          if (pFile->cState == PIL_FILE_STATE_LOADED)
-	 {
-         	p = pOldPage = &pFile->pData[pPage->iOffset];
-		pPage->pData = PILIOAlloc(pPage->iDataSize);
-	 }
+            {
+            p = &pFile->pData[pPage->iOffset];
+            if (pFile->bMapped && pFile->pGIFFrames)
+               PILGIFPrefetch(pFile, iRequestedPage);
+            }
+         else if (pFile->pGIFWindow) // streaming, bring the page into the window
+            {
+            p = PILGIFWindowFetch(pFile, pPage->iOffset, pPage->iDataSize);
+            if (p == NULL)
+               {
+               iErr = PIL_ERROR_IO;
+               goto quit_gif;
+               }
+            }
        	else
-            p = pOldPage = &pPage->pData[pPage->iOffset];
+            p = &pPage->pData[pPage->iOffset];
          if (iRequestedPage == 0)
             {
             pPage->iPageWidth = INTELSHORT(&p[6]);
@@ -102,7 +328,8 @@ unsigned char c, *d, *p, *pOldPage;
                   else
                      pPage->cPhotometric = PIL_PHOTOMETRIC_BLACKISZERO;
                   }
-			   pPage->pPalette = (unsigned char *) PILIOAlloc(768); /* Allocate fixed size color palette */
+			   if (pPage->pPalette == NULL) /* a reused page keeps its palette */
+				   pPage->pPalette = (unsigned char *) PILIOAlloc(768); /* Allocate fixed size color palette */
 			   if (pPage->pPalette == NULL)
 			   {
 				   iErr = PIL_ERROR_MEMORY;
@@ -110,10 +337,24 @@ unsigned char c, *d, *p, *pOldPage;
 			   }
                memcpy(pPage->pPalette, &p[iOffset], 3*(1 << pPage->cBitsperpixel));
                PILFixGIFRGB(pPage->pPalette); /* Fix RGB byte order */
+               PILGIFPalette(pFile, pPage->iOffset + iOffset, &p[iOffset], 1 << pPage->cBitsperpixel, TRUE);
                iOffset += 3 * (1 << pPage->cBitsperpixel);
                }
             }
-         while (p[iOffset] != ',') /* Wait for image separator */
+         if (pFrame) // already scanned, take the frame's details from the table
+            {
+            pPage->cGIFBits = pFrame->ucGIFBits;
+            pPage->iFrameDelay = pFrame->iFrameDelay;
+            if (pPage->cGIFBits & 1) // transparent color is used
+               pPage->iTransparent = (int)pFrame->ucTransparent;
+            pPage->iX = pFrame->usX;
+            pPage->iY = pFrame->usY;
+            pPage->iWidth = pFrame->usWidth;
+            pPage->iHeight = pFrame->usHeight;
+            iMap = pFrame->ucMap;
+            iOffset = pFrame->u32Palette; // the table's offsets are from the start of the page
+            }
+         while (pFrame == NULL && p[iOffset] != ',') /* Wait for image separator */
             {
             if (p[iOffset] == '!') /* Extension block */
                {
@@ -188,7 +429,10 @@ unsigned char c, *d, *p, *pOldPage;
                   default:
                      iErr = PIL_ERROR_BADHEADER; /* Bad header info */
                      if (pPage->cBitsperpixel != 1)
+                        {
                         PILIOFree(pPage->pPalette);
+                        pPage->pPalette = NULL;
+                        }
                      goto quit_gif;
                   } /* switch */
                }
@@ -196,17 +440,24 @@ unsigned char c, *d, *p, *pOldPage;
                {
                iErr = PIL_ERROR_BADHEADER; /* Bad header info */
                if (pPage->cBitsperpixel != 1)
+                  {
                   PILIOFree(pPage->pPalette);
+                  pPage->pPalette = NULL;
+                  }
                goto quit_gif;
                }
             } /* while */
-         if (p[iOffset] == ',')
-            iOffset++;
-         pPage->iX = INTELSHORT(&p[iOffset]);
-         pPage->iY = INTELSHORT(&p[iOffset+2]);
-         pPage->iWidth = INTELSHORT(&p[iOffset+4]);
-         pPage->iHeight = INTELSHORT(&p[iOffset+6]);
-         iOffset += 8;
+         if (pFrame == NULL)
+            {
+            if (p[iOffset] == ',')
+               iOffset++;
+            pPage->iX = INTELSHORT(&p[iOffset]);
+            pPage->iY = INTELSHORT(&p[iOffset+2]);
+            pPage->iWidth = INTELSHORT(&p[iOffset+4]);
+            pPage->iHeight = INTELSHORT(&p[iOffset+6]);
+            iOffset += 8;
+            iMap = p[iOffset++];
+            }
    /* Image descriptor
      7 6 5 4 3 2 1 0    M=0 - use global color map, ignore pixel
      M I 0 0 0 pixel    M=1 - local color map follows, use pixel
@@ -214,7 +465,11 @@ unsigned char c, *d, *p, *pOldPage;
                         I=1 - Image in interlaced order
                         pixel+1 = # bits per pixel for this image
    */
-         iMap = p[iOffset++];
+         if (pPage->pLocalPalette && (!(iMap & 0x80) || (iRequestedPage == 0 && pPage->pPalette == NULL))) // page is being reused, drop the last frame's color table
+            {
+            PILIOFree(pPage->pLocalPalette);
+            pPage->pLocalPalette = NULL;
+            }
          if (iMap & 0x80) // local color table?
             {
             if (iRequestedPage == 0 && pPage->pPalette == NULL) // no global color table defined, use local as global
@@ -228,6 +483,16 @@ unsigned char c, *d, *p, *pOldPage;
                i = 3 * (1 << ((iMap & 7)+1)); // get the size of the color table specified
                memcpy(pPage->pPalette, &p[iOffset], i);
                PILFixGIFRGB(pPage->pPalette); /* Fix RGB byte order */
+               pPage->pGIFPalette = PILGIFPalette(pFile, pPage->iOffset + iOffset, &p[iOffset], i/3, TRUE);
+               }
+            else if ((pPage->pGIFPalette = PILGIFPalette(pFile, pPage->iOffset + iOffset, &p[iOffset], 1 << ((iMap & 7)+1), FALSE)) != NULL)
+               { // shared from the cache, nothing to copy
+               i = 3 * (1 << ((iMap & 7)+1));
+               if (pPage->pLocalPalette) // left from a frame read before the cache was there
+                  {
+                  PILIOFree(pPage->pLocalPalette);
+                  pPage->pLocalPalette = NULL;
+                  }
                }
             else
                { // keep both global and local color tables
@@ -246,28 +511,14 @@ unsigned char c, *d, *p, *pOldPage;
                }
             iOffset += i;
             }
-         codestart = p[iOffset++]; /* initial code size */
-         /* Since GIF can be 1-8 bpp, we only allow 1,4,8 */
-         pPage->cBitsperpixel = cGIFBits[codestart];
-         // we are re-using the same buffer turning GIF file data
-         // into "pure" LZW
-         d = pPage->pData;
-         *d++ = (unsigned char)iMap; /* Store the map attributes */
-         *d++ = (unsigned char)codestart; /* And the starting code */
-         iDataLen = 2; /* Length of GIF data */
-         c = p[iOffset++]; /* This block length */
-         while (c && (iOffset+c) <= pPage->iDataSize) /* Collect all of the data packets together */
-            {
-            memcpy(d, &p[iOffset], c);
-            iOffset += c;
-            d += c;
-            iDataLen += c; /* Overall data length */
-            c = p[iOffset++];
-            }
-         if ((iOffset+c) > pPage->iDataSize) /* Error, we went beyond end of buffer */
+         else if (pFile->pGIFPalettes && pFile->pGIFPalettes->pal[0].iOffset != 0) // the global color table
+            pPage->pGIFPalette = &pFile->pGIFPalettes->pal[0];
+         if (iOffset < pPage->iDataSize)
+            codestart = p[iOffset]; /* initial code size */
+         else
+            codestart = 0; /* truncated frame */
+         if (codestart < 2 || codestart > 8)
             {
-            PILIOFree(pPage->pData);
-            pPage->pData = NULL;
             if (pPage->pPalette)
                {
                PILIOFree(pPage->pPalette);
@@ -281,9 +532,17 @@ unsigned char c, *d, *p, *pOldPage;
             iErr = PIL_ERROR_DECOMP;
             goto quit_gif;
             }
-         pPage->iDataSize = iDataLen; /* Total bytes of GIF data */
-         pPage->cState = PIL_PAGE_STATE_LOADED; // since we have to repack the data
-         pPage->iOffset = 0; // since we repacked the data
+         /* Since GIF can be 1-8 bpp, we only allow 1,4,8 */
+         pPage->cBitsperpixel = cGIFBits[codestart];
+         pPage->cGIFMap = (unsigned char)iMap; /* Store the map attributes */
+         // The LZW sub-blocks are left where they are; PILDecodeGIF() decodes
+         // them in place starting from the code size byte
+         pPage->iOffset += iOffset;
+         pPage->iDataSize -= iOffset;
+         if (pFile->cState == PIL_FILE_STATE_LOADED || pFile->pGIFWindow)
+            pPage->cState = PIL_PAGE_STATE_OPEN; // data is still in the file
+         else
+            pPage->cState = PIL_PAGE_STATE_LOADED;
          pPage->iPitch = PILCalcSize(pPage->iWidth, pPage->cBitsperpixel);
          pFile->cBpp = pPage->cBitsperpixel;
          pFile->cCompression = PIL_COMP_LZW;
@@ -293,59 +552,162 @@ quit_gif:
 
 /****************************************************************************
  *                                                                          *
- *  FUNCTION   : PILAnimateGIF()                                            *
+ *  FUNCTION   : PILGIFPageView()                                           *
  *                                                                          *
- *  PURPOSE    : BitBlt the new data onto the old page for animation (GIF). *
+ *  PURPOSE    : Get the visible rectangle of the animation page.           *
  *                                                                          *
  ****************************************************************************/
-int PILAnimateGIF(PIL_PAGE *pDestPage, PIL_PAGE *pSrcPage)
+//
+// iViewCX/iViewCY == 0 means the whole page is visible. Pixels outside the
+// view are never drawn, disposed of or saved, so what's left there is
+// undefined.
+//
+void PILGIFPageView(PIL_PAGE *pPage, int *pX0, int *pY0, int *pX1, int *pY1)
 {
-#ifndef JPEG_DECODE_ONLY
+	if (pPage->iViewCX <= 0 || pPage->iViewCY <= 0)
+	{
+		*pX0 = *pY0 = 0;
+		*pX1 = pPage->iWidth;
+		*pY1 = pPage->iHeight;
+		return;
+	}
+	*pX0 = (pPage->iViewX > 0) ? pPage->iViewX : 0;
+	*pY0 = (pPage->iViewY > 0) ? pPage->iViewY : 0;
+	*pX1 = pPage->iViewX + pPage->iViewCX;
+	*pY1 = pPage->iViewY + pPage->iViewCY;
+	if (*pX1 > pPage->iWidth)
+		*pX1 = pPage->iWidth;
+	if (*pY1 > pPage->iHeight)
+		*pY1 = pPage->iHeight;
+	if (*pX1 < *pX0)
+		*pX1 = *pX0;
+	if (*pY1 < *pY0)
+		*pY1 = *pY0;
+} /* PILGIFPageView() */
 
-unsigned char c, *s, *d, cTransparent;
-int x, y;
-unsigned char ucDisposalFlags;
-//unsigned char *pTempLine;
-//unsigned char *irlcptr;
-//unsigned char **indexbuf;
-unsigned char *pPalette;
-unsigned char r, g, b;
-unsigned short usColor, *ds, *pusPalette;
-uint32_t ul, *pul;
-uint32_t *pulPalette = NULL;
+/****************************************************************************
+ *                                                                          *
+ *  FUNCTION   : PILGIFAddDirty()                                           *
+ *                                                                          *
+ *  PURPOSE    : Add a changed area to the animation page's dirty list.     *
+ *                                                                          *
+ ****************************************************************************/
+//
+// The list has room for the disposed area and the new frame. When they
+// overlap enough that their bounding box isn't bigger than the two of
+// them, they're merged so the overlap isn't copied twice.
+//
+static void PILGIFAddDirty(PIL_PAGE *pPage, int x0, int y0, int x1, int y1)
+{
+PILRECT *pRect;
+int bx0, by0, bx1, by1;
 
-   pusPalette = NULL;
-   if (pDestPage == NULL || pSrcPage == NULL)
-	   return PIL_ERROR_INVPARAM;
-   if (pDestPage->pData == NULL || pSrcPage->pData == NULL || pDestPage->pPalette == NULL) // must have destination buffer, src buffer & global color table
-	   return PIL_ERROR_INVPARAM;
-   if (pDestPage->cBitsperpixel != 24 && pDestPage->cBitsperpixel != 16 && pDestPage->cBitsperpixel != 32)
-	   return PIL_ERROR_BITDEPTH;
-   if (pSrcPage->iX < 0 || pSrcPage->iY < 0 || (pSrcPage->iX + pSrcPage->iWidth) > pDestPage->iWidth || (pSrcPage->iY + pSrcPage->iHeight) > pDestPage->iHeight)
-         return PIL_ERROR_INVPARAM; // bad parameter
+	if (x1 <= x0 || y1 <= y0)
+		return;
+	if (pPage->iDirtyCount == 1)
+	{
+		pRect = &pPage->rDirty[0];
+		bx0 = ((int)pRect->Left < x0) ? (int)pRect->Left : x0;
+		by0 = ((int)pRect->Top < y0) ? (int)pRect->Top : y0;
+		bx1 = ((int)pRect->Right > x1) ? (int)pRect->Right : x1;
+		by1 = ((int)pRect->Bottom > y1) ? (int)pRect->Bottom : y1;
+		if ((bx1 - bx0) * (by1 - by0) <= (int)((pRect->Right - pRect->Left) * (pRect->Bottom - pRect->Top)) + (x1 - x0) * (y1 - y0))
+		{
+			x0 = bx0; y0 = by0; x1 = bx1; y1 = by1;
+			pPage->iDirtyCount = 0;
+		}
+	}
+	pRect = &pPage->rDirty[pPage->iDirtyCount++];
+	pRect->Left = x0;
+	pRect->Top = y0;
+	pRect->Right = x1;
+	pRect->Bottom = y1;
+} /* PILGIFAddDirty() */
 
-   pPalette = (unsigned char *)PILIOAlloc(2048); // use global or local palette
-   if (pPalette == NULL)
-      return PIL_ERROR_MEMORY;
-   memcpy(pPalette, pDestPage->pPalette, 768); // start with the global color table
-// get local color table changes (if present)
-   if (pSrcPage->pLocalPalette) // use local palette
-      memcpy(pPalette, pSrcPage->pLocalPalette, 768);
-   // Create a RGB565 palette
-   if (pDestPage->cBitsperpixel == 16)
+/****************************************************************************
+ *                                                                          *
+ *  FUNCTION   : PILGIFFillRect()                                           *
+ *                                                                          *
+ *  PURPOSE    : Fill part of the animation page with one color.            *
+ *                                                                          *
+ ****************************************************************************/
+//
+// The first row is built by doubling the run of pixels already written and
+// the others are copies of it, so all of the stores are memcpy sized
+// whatever the pixel format (including 3-byte 24bpp pixels).
+//
+static void PILGIFFillRect(PIL_PAGE *pPage, int x0, int y0, int x1, int y1, unsigned char *pPixel)
+{
+unsigned char *d, *pRow;
+int y, iBytes, iLen, iDone, iCopy;
+
+	if (x1 <= x0 || y1 <= y0)
+		return;
+	iBytes = pPage->cBitsperpixel >> 3;
+	iLen = (x1 - x0) * iBytes;
+	pRow = pPage->pData + (y0 * pPage->iPitch) + (x0 * iBytes);
+	memcpy(pRow, pPixel, iBytes);
+	for (iDone = iBytes; iDone < iLen; iDone += iCopy)
+	{
+		iCopy = (iDone < iLen - iDone) ? iDone : iLen - iDone;
+		memcpy(pRow + iDone, pRow, iCopy);
+	}
+	d = pRow;
+	for (y=y0+1; y<y1; y++)
+	{
+		d += pPage->iPitch;
+		memcpy(d, pRow, iLen);
+	}
+} /* PILGIFFillRect() */
+
+/****************************************************************************
+ *                                                                          *
+ *  FUNCTION   : PILGIFConvertPalette()                                     *
+ *                                                                          *
+ *  PURPOSE    : Convert a 256-color table to the page's pixel format.      *
+ *                                                                          *
+ ****************************************************************************/
+static void PILGIFConvertPalette(unsigned char *pPalette, int iBpp, int iFormat, void *pOut)
+{
+int x;
+unsigned short usColor, *ds;
+uint32_t ul, *pul;
+unsigned char *d;
+
+   if (iBpp == 16)
    {
-	   ds = pusPalette = (unsigned short *)&pPalette[1024];
+	   ds = (unsigned short *)pOut;
 	   for (x=0; x<256; x++)
 	   {
 		   usColor = pPalette[x*3]>>3; // b
 		   usColor |= ((pPalette[(x*3)+1]>>2)<<5); // g
 		   usColor |= ((pPalette[(x*3)+2]>>3)<<11); // r
+		   if (iFormat == PIL_GIF_FORMAT_RGB565_BE)
+			   usColor = (unsigned short)((usColor >> 8) | (usColor << 8));
 		   *ds++ = usColor;
 	   }
    }
-   else if (pDestPage->cBitsperpixel == 32)
+   else if (iBpp == 24) // RGB666 (native 24bpp uses the table as is)
+   {
+	   d = (unsigned char *)pOut;
+	   for (x=0; x<256; x++)
+	   {
+		   *d++ = pPalette[(x*3)+2] & 0xfc; // r
+		   *d++ = pPalette[(x*3)+1] & 0xfc; // g
+		   *d++ = pPalette[x*3] & 0xfc; // b
+	   }
+   }
+   else if (iBpp == 8) // RGB332
    {
-	   pul = pulPalette = (uint32_t *)&pPalette[1024];
+	   d = (unsigned char *)pOut;
+	   for (x=0; x<256; x++)
+	   {
+		   *d++ = (pPalette[(x*3)+2] & 0xe0) | ((pPalette[(x*3)+1] & 0xe0) >> 3) | (pPalette[x*3] >> 6);
+	   }
+   }
+   else
+   {
+	   pul = (uint32_t *)pOut;
 	   for (x=0; x<256; x++)
 	   {
            ul = 0xff000000;
@@ -355,485 +717,2047 @@ uint32_t *pulPalette = NULL;
 		   *pul++ = ul;
 	   }
    }
+} /* PILGIFConvertPalette() */
 
-// Dispose of the last frame according to the previous page disposal flags
-	ucDisposalFlags = (pDestPage->cGIFBits & 0x1c)>>2; // bits 2-4 = disposal flags
-	switch (ucDisposalFlags)
+/****************************************************************************
+ *                                                                          *
+ *  FUNCTION   : PILGIFCompose16() / PILGIFCompose32()                      *
+ *                                                                          *
+ *  PURPOSE    : Portable row kernels: 8-bit indices to RGB565 / ARGB.      *
+ *                                                                          *
+ ****************************************************************************/
+//
+// Transparent pixels are handled as a select instead of a branch so that
+// frames with scattered transparency don't pay for a misprediction on every
+// other pixel. iTransparent of -1 never matches an index.
+//
+static void PILGIFCompose16(void *pDest, unsigned char *s, int iCount, void *pPalette, int iTransparent)
+{
+unsigned short *d = (unsigned short *)pDest;
+unsigned short *pusPalette = (unsigned short *)pPalette;
+unsigned short p0, p1, p2, p3;
+int x, c;
+
+	if (iTransparent < 0)
 	{
-	case 0: // not specified - nothing to do
-	case 1: // do not dispose
-		break;
-	case 2: // restore to background color
-		if (pDestPage->cBitsperpixel == 24)
+		for (x=0; x<iCount-3; x+=4)
 		{
-		   b = pPalette[pDestPage->cBackground * 3];
-		   g = pPalette[(pDestPage->cBackground * 3) + 1];
-		   r = pPalette[(pDestPage->cBackground * 3) + 2];
-		   if (pDestPage->cBackground == pDestPage->iTransparent) // transparent background, default to white
-		      {
-		      r = b = g = 0xff;
-		      }
-		   for (y=0; y<pDestPage->iCY; y++)
-			  {
-			  d = pDestPage->pData + (pDestPage->iPitch * (pDestPage->iY + y)) + (pDestPage->iX * 3);
-			  for (x=0; x<pDestPage->iCX; x++)
-				 {
-				 *d++ = b;
-				 *d++ = g;
-				 *d++ = r;
-				 }
-			  }
+			d[x] = pusPalette[s[x]];
+			d[x+1] = pusPalette[s[x+1]];
+			d[x+2] = pusPalette[s[x+2]];
+			d[x+3] = pusPalette[s[x+3]];
 		}
-		else if (pDestPage->cBitsperpixel == 32)
+		for (; x<iCount; x++)
+			d[x] = pusPalette[s[x]];
+	}
+	else
+	{
+		// look up 4 pixels before touching the destination so the loads
+		// don't wait on the previous stores
+		for (x=0; x<iCount-3; x+=4)
 		{
-           ul = 0xff000000;
-		   ul |= (pPalette[pDestPage->cBackground * 3]<<16);
-		   ul |= (pPalette[(pDestPage->cBackground * 3) + 1]<<8);
-		   ul |= pPalette[(pDestPage->cBackground * 3) + 2];
-		   if (pDestPage->cBackground == pDestPage->iTransparent) // transparent background, default to white
-		      {
-		      ul = 0xffffffff;
-		      }
-		   for (y=0; y<pDestPage->iCY; y++)
-			  {
-			  pul = (uint32_t *)(pDestPage->pData + (pDestPage->iPitch * (pDestPage->iY + y)) + (pDestPage->iX << 2));
-			  for (x=0; x<pDestPage->iCX; x++)
-				 {
-				 *pul++ = ul;
-				 }
-			  }
+			p0 = pusPalette[s[x]]; p1 = pusPalette[s[x+1]];
+			p2 = pusPalette[s[x+2]]; p3 = pusPalette[s[x+3]];
+			if (s[x] == iTransparent) p0 = d[x];
+			if (s[x+1] == iTransparent) p1 = d[x+1];
+			if (s[x+2] == iTransparent) p2 = d[x+2];
+			if (s[x+3] == iTransparent) p3 = d[x+3];
+			d[x] = p0; d[x+1] = p1; d[x+2] = p2; d[x+3] = p3;
 		}
-		else if (pDestPage->cBitsperpixel == 16)// 16bpp
+		for (; x<iCount; x++)
 		{
-		   usColor = pusPalette[pDestPage->cBackground];
-		   if (pDestPage->cBackground == pDestPage->iTransparent) // transparent background, default to white
-		      {
-		      usColor = 0xffff;
-		      }
-		   for (y=0; y<pDestPage->iCY; y++)
-			  {
-			  ds = (unsigned short *)&pDestPage->pData[(pDestPage->iPitch * (pDestPage->iY + y)) + (pDestPage->iX * 2)];
-			  for (x=0; x<pDestPage->iCX; x++)
-				 {
-				 *ds++ = usColor;
-				 }
-			  }
+			c = s[x];
+			if (c != iTransparent)
+				d[x] = pusPalette[c];
 		}
-		break;
-	case 3: // restore to previous frame
-	   if (pDestPage->lUser) // if we saved it
-	      {
-	      for (y=0; y<pDestPage->iCY; y++)
-	         {
-			 if (pDestPage->cBitsperpixel == 24)
-				 {
-				 d = pDestPage->pData + (pDestPage->iPitch * (pDestPage->iY + y)) + (pDestPage->iX * 3);
-				 s = (unsigned char *)pDestPage->lUser;
-				 s += (pDestPage->iPitch * (pDestPage->iY + y)) + (pDestPage->iX * 3);
-				 memcpy(d, s, pDestPage->iCX * 3);
-				 }
-			 if (pDestPage->cBitsperpixel == 32)
-				 {
-				 d = pDestPage->pData + (pDestPage->iPitch * (pDestPage->iY + y)) + (pDestPage->iX << 2);
-				 s = (unsigned char *)pDestPage->lUser;
-				 s += (pDestPage->iPitch * (pDestPage->iY + y)) + (pDestPage->iX << 2);
-				 memcpy(d, s, pDestPage->iCX << 2);
-				 }
-			 else if (pDestPage->cBitsperpixel == 16)
-				{
-				 d = &pDestPage->pData[(pDestPage->iPitch * (pDestPage->iY + y)) + (pDestPage->iX * 2)];
-				 s = (unsigned char *)pDestPage->lUser;
-				 s += (pDestPage->iPitch * (pDestPage->iY + y)) + (pDestPage->iX * 2);
-				 memcpy(d, s, pDestPage->iCX * 2);
-				}
-	         }
-	      }
-		break;
-	default: // not defined
-		break;
 	}
+} /* PILGIFCompose16() */
 
- // if this frame uses disposal method 3, we need to prepare for the next frame
- // by saving the current image before it gets modified
- 	if (((pSrcPage->cGIFBits & 0x1c)>>2) == 3)
- 	   {
-      // Copy this frame to a swap buffer so that the disposal method 3 can work
-      // this can be done more efficiently (memory, time), but keep it simple for now
-      if (pDestPage->lUser == NULL) // not allocated yet
-         {
-		  pDestPage->lUser = (void *) PILIOAlloc(pDestPage->iDataSize);
-		 if (pDestPage->lUser == NULL)
-			 return PIL_ERROR_MEMORY;
-         }
-      memcpy((void *)pDestPage->lUser, pDestPage->pData, pDestPage->iDataSize);
-      }
-
-   switch (pSrcPage->cBitsperpixel)
-      {
-      case 4:
-         // Draw new sub-image onto animation bitmap
-         if (pSrcPage->cGIFBits & 1) // if transparency used
-            {
-            cTransparent = (unsigned char)pSrcPage->iTransparent;
-            }
-         else
-            {
-            cTransparent = 16; // a value which will never match
-            }
-         for (y=0; y<pSrcPage->iHeight; y++)
-            {
-            s = pSrcPage->pData + (y * pSrcPage->iPitch);
-			if (pDestPage->cBitsperpixel == 24)
-			    {
-				d = pDestPage->pData + (pDestPage->iPitch * (pSrcPage->iY + y)) + (pSrcPage->iX * 3);
-				for (x=0; x<pSrcPage->iWidth; x++)
-				   {
-				   if (!(x & 1))
-					  c = ((*s)>> 4) & 0xf;
-				   else
-					  c = (*s++) & 0xf;
-				  if (c != cTransparent)
-					 {
-					 *d++ = pPalette[c*3];
-					 *d++ = pPalette[(c*3)+1];
-					 *d++ = pPalette[(c*3)+2];
-					 }
-				  else
-					 {
-					 d += 3;
-					 }
-				   } // for x
-			    }
-			else if (pDestPage->cBitsperpixel == 16)
-			    {
-				ds = (unsigned short *)&pDestPage->pData[(pDestPage->iPitch * (pSrcPage->iY + y)) + (pSrcPage->iX * 2)];
-				for (x=0; x<pSrcPage->iWidth; x++)
-				   {
-				   if (!(x & 1))
-					  c = ((*s)>> 4) & 0xf;
-				   else
-					  c = (*s++) & 0xf;
-				  if (c != cTransparent)
-					 {
-					 *ds++ = pusPalette[c];
-					 }
-				  else
-					 {
-					 ds++;
-					 }
-				   } // for x
-		     	}
-			else if (pDestPage->cBitsperpixel == 32)
-			    {
-				pul = (uint32_t *)&pDestPage->pData[(pDestPage->iPitch * (pSrcPage->iY + y)) + (pSrcPage->iX * 4)];
-				for (x=0; x<pSrcPage->iWidth; x++)
-				   {
-				   if (!(x & 1))
-					  c = ((*s)>> 4) & 0xf;
-				   else
-					  c = (*s++) & 0xf;
-				  if (c != cTransparent)
-					 {
-					 *pul++ = pulPalette[c];
-					 }
-				  else
-					 {
-					 pul++;
-					 }
-				   } // for x
-		     	}
-            } // for y
-         break;
-      case 8:
-         // Draw new sub-image onto animation bitmap
-         if (pSrcPage->cGIFBits & 1) // if transparency used
-            {
-            cTransparent = (unsigned char)pSrcPage->iTransparent;
-            for (y=0; y<pSrcPage->iHeight; y++)
-               {
-               s = pSrcPage->pData + (y * pSrcPage->iPitch);
-			   if (pDestPage->cBitsperpixel == 24)
-			       {
-				   d = pDestPage->pData + (pDestPage->iPitch * (pSrcPage->iY + y)) + (pSrcPage->iX * 3);
-				   for (x=0; x<pSrcPage->iWidth; x++)
-					  {
-					  c = *s++;
-					  if (c != cTransparent)
-						 {
-						 *d++ = pPalette[c*3];
-						 *d++ = pPalette[(c*3)+1];
-						 *d++ = pPalette[(c*3)+2];
-						 }
-					  else
-						 {
-						 d += 3;
-						 }
-					  } // for x
-				   }
- 			    else if (pDestPage->cBitsperpixel == 32)
-			  	   {
-				   pul = (uint32_t *)&pDestPage->pData[(pDestPage->iPitch * (pSrcPage->iY + y)) + (pSrcPage->iX * 4)];
-				   for (x=0; x<pSrcPage->iWidth; x++)
-					  {
-					  c = *s++;
-					  if (c != cTransparent)
-						 {
-						 *pul++ = pulPalette[c];
-						 }
-					  else
-						 {
-						 pul++;
-						 }
-					  } // for x
-			       }
- 			    else if (pDestPage->cBitsperpixel == 16)
-			  	   {
-				   ds = (unsigned short *)&pDestPage->pData[(pDestPage->iPitch * (pSrcPage->iY + y)) + (pSrcPage->iX * 2)];
-				   for (x=0; x<pSrcPage->iWidth; x++)
-					  {
-					  c = *s++;
-					  if (c != cTransparent)
-						 {
-						 *ds++ = pusPalette[c];
-						 }
-					  else
-						 {
-						 ds++;
-						 }
-					  } // for x
-			       }
-               } // for y
-            }
-         else // no transparency
-            {
-            for (y=0; y<pSrcPage->iHeight; y++)
-               {
-               s = pSrcPage->pData + (y * pSrcPage->iPitch);
-			   if (pDestPage->cBitsperpixel == 24)
-			       {
-				   d = pDestPage->pData + (pDestPage->iPitch * (pSrcPage->iY + y)) + (pSrcPage->iX * 3);
-				   for (x=0; x<pSrcPage->iWidth; x++)
-					  {
-					  c = *s++;
-					  *d++ = pPalette[c*3];
-					  *d++ = pPalette[(c*3)+1];
-					  *d++ = pPalette[(c*3)+2];
-					  } // for x
-				   }
-			   else if (pDestPage->cBitsperpixel == 32)
-			       {
-				   pul = (uint32_t *)(pDestPage->pData + (pDestPage->iPitch * (pSrcPage->iY + y)) + (pSrcPage->iX * 4));
-				   for (x=0; x<pSrcPage->iWidth; x++)
-					  {
-					  c = *s++;
-					  *pul++ = pulPalette[c];
-					  } // for x
-				   }
-			   else if (pDestPage->cBitsperpixel == 16)
-			       {
-			       uint32_t ul, *pul;
-				   pul = (uint32_t *)&pDestPage->pData[(pDestPage->iPitch * (pSrcPage->iY + y)) + (pSrcPage->iX * 2)];
-                   x = 0;
-                   if ((pSrcPage->iX & 1) == 0) // must be dword-aligned
-                      {
-				      for (; x<pSrcPage->iWidth-1; x+=2)
-					     {
-					     ul = pusPalette[*s++];
-					     ul |= (pusPalette[*s++] << 16);
-					     *pul++ = ul;
-					     } // for x
-                      }
-                   ds = (unsigned short *)pul;
-				   for (; x<pSrcPage->iWidth; x++) // odd starting point and/or odd width
-				      {
-				      *ds++ = pusPalette[*s++];
-				      }
-			       }
-               } // for y
-            }
-         break;
-      }
-#endif // JPEG_DECODE_ONLY
-
-// need to hold last frame info for posible "disposition" on the next frame
-   pDestPage->cGIFBits = pSrcPage->cGIFBits;
-   pDestPage->iFrameDelay = pSrcPage->iFrameDelay;
-   pDestPage->iX = pSrcPage->iX;
-   pDestPage->iY = pSrcPage->iY;
-   pDestPage->iCX = pSrcPage->iWidth;
-   pDestPage->iCY = pSrcPage->iHeight;
-   PILIOFree(pPalette); // free temp palette
-   return 0;
+static void PILGIFCompose32(void *pDest, unsigned char *s, int iCount, void *pPalette, int iTransparent)
+{
+uint32_t *d = (uint32_t *)pDest;
+uint32_t *pulPalette = (uint32_t *)pPalette;
+uint32_t p0, p1, p2, p3;
+int x, c;
 
-} /* PILAnimateGIF() */
+	if (iTransparent < 0)
+	{
+		for (x=0; x<iCount-3; x+=4)
+		{
+			d[x] = pulPalette[s[x]];
+			d[x+1] = pulPalette[s[x+1]];
+			d[x+2] = pulPalette[s[x+2]];
+			d[x+3] = pulPalette[s[x+3]];
+		}
+		for (; x<iCount; x++)
+			d[x] = pulPalette[s[x]];
+	}
+	else
+	{
+		// look up 4 pixels before touching the destination so the loads
+		// don't wait on the previous stores
+		for (x=0; x<iCount-3; x+=4)
+		{
+			p0 = pulPalette[s[x]]; p1 = pulPalette[s[x+1]];
+			p2 = pulPalette[s[x+2]]; p3 = pulPalette[s[x+3]];
+			if (s[x] == iTransparent) p0 = d[x];
+			if (s[x+1] == iTransparent) p1 = d[x+1];
+			if (s[x+2] == iTransparent) p2 = d[x+2];
+			if (s[x+3] == iTransparent) p3 = d[x+3];
+			d[x] = p0; d[x+1] = p1; d[x+2] = p2; d[x+3] = p3;
+		}
+		for (; x<iCount; x++)
+		{
+			c = s[x];
+			if (c != iTransparent)
+				d[x] = pulPalette[c];
+		}
+	}
+} /* PILGIFCompose32() */
 
+#ifdef PIL_GIF_X86_SIMD
 /****************************************************************************
  *                                                                          *
- *  FUNCTION   : PILMakeGifPels(signed short *, unsigned char *, short, int *, PILBOOL) *
+ *  FUNCTION   : PILGIFCompose16SSE2() / PILGIFCompose32SSE2()              *
  *                                                                          *
- *  PURPOSE    : Convert a linked list of codes into pixel data.            *
+ *  PURPOSE    : SSE2 row kernels: 8 pixels per step, blended by mask.      *
  *                                                                          *
  ****************************************************************************/
-unsigned char *PILMakeGifPels(unsigned short *giftabs, unsigned char *templine, unsigned char *linebuf, unsigned int code, int *xcount, unsigned char *buf, int *y, PIL_PAGE *pPage, unsigned char **irlcptr, int lsize, PILBOOL bGIF)
+//
+// SSE2 has no gather, so the palette lookups stay scalar; the win is in
+// building the transparency mask 8 pixels at a time, skipping groups which
+// are completely transparent and writing the rest with one blended store.
+//
+__attribute__((target("sse2")))
+static void PILGIFCompose16SSE2(void *pDest, unsigned char *s, int iCount, void *pPalette, int iTransparent)
 {
-int i, k, iPixCount;
-unsigned char *s, *pEnd;
-//unsigned char **index = NULL;
-
-//   if (pPage->cBitsperpixel == 1)
-//      index = (unsigned char **)pPage->pData;
+unsigned short *d = (unsigned short *)pDest;
+unsigned short *p = (unsigned short *)pPalette;
+__m128i xmmZero, xmmT, xmmIdx, xmmMask, xmmPix;
+int x, iMask;
 
-   /* Copy this string of sequential pixels to output buffer */
-//   iPixCount = 0;
-   s = linebuf + 65536; /* Pixels will come out in reversed order */
+	if (iTransparent < 0) // nothing to blend; scalar lookups are as fast on their own
+	{
+		PILGIFCompose16(pDest, s, iCount, pPalette, iTransparent);
+		return;
+	}
+	xmmZero = _mm_setzero_si128();
+	xmmT = _mm_set1_epi16((short)iTransparent); // -1 never matches a zero-extended index
+	for (x=0; x<iCount-7; x+=8)
+	{
+		xmmIdx = _mm_unpacklo_epi8(_mm_loadl_epi64((__m128i *)&s[x]), xmmZero);
+		xmmMask = _mm_cmpeq_epi16(xmmIdx, xmmT);
+		iMask = _mm_movemask_epi8(xmmMask);
+		if (iMask == 0xffff) // all transparent
+			continue;
+		xmmPix = _mm_set_epi16(p[s[x+7]], p[s[x+6]], p[s[x+5]], p[s[x+4]], p[s[x+3]], p[s[x+2]], p[s[x+1]], p[s[x]]);
+		if (iMask) // keep the destination under the transparent pixels
+			xmmPix = _mm_or_si128(_mm_and_si128(xmmMask, _mm_loadu_si128((__m128i *)&d[x])), _mm_andnot_si128(xmmMask, xmmPix));
+		_mm_storeu_si128((__m128i *)&d[x], xmmPix);
+	}
+	PILGIFCompose16(&d[x], &s[x], iCount - x, pPalette, iTransparent);
+} /* PILGIFCompose16SSE2() */
 
-   while (code < CT_OLD)
+__attribute__((target("sse2")))
+static void PILGIFCompose32SSE2(void *pDest, unsigned char *s, int iCount, void *pPalette, int iTransparent)
+{
+uint32_t *d = (uint32_t *)pDest;
+uint32_t *p = (uint32_t *)pPalette;
+__m128i xmmZero, xmmT, xmmIdx, xmmMask, xmmMask2, xmmPix, xmmPix2;
+int x, iMask;
+
+	if (iTransparent < 0) // nothing to blend; scalar lookups are as fast on their own
+	{
+		PILGIFCompose32(pDest, s, iCount, pPalette, iTransparent);
+		return;
+	}
+	xmmZero = _mm_setzero_si128();
+	xmmT = _mm_set1_epi16((short)iTransparent);
+	for (x=0; x<iCount-7; x+=8)
+	{
+		xmmIdx = _mm_unpacklo_epi8(_mm_loadl_epi64((__m128i *)&s[x]), xmmZero);
+		xmmMask = _mm_cmpeq_epi16(xmmIdx, xmmT);
+		iMask = _mm_movemask_epi8(xmmMask);
+		if (iMask == 0xffff) // all transparent
+			continue;
+		xmmPix = _mm_set_epi32(p[s[x+3]], p[s[x+2]], p[s[x+1]], p[s[x]]);
+		xmmPix2 = _mm_set_epi32(p[s[x+7]], p[s[x+6]], p[s[x+5]], p[s[x+4]]);
+		if (iMask)
+		{
+			// widen the 16-bit mask to one per 32-bit pixel
+			xmmMask2 = _mm_unpackhi_epi16(xmmMask, xmmMask);
+			xmmMask = _mm_unpacklo_epi16(xmmMask, xmmMask);
+			xmmPix = _mm_or_si128(_mm_and_si128(xmmMask, _mm_loadu_si128((__m128i *)&d[x])), _mm_andnot_si128(xmmMask, xmmPix));
+			xmmPix2 = _mm_or_si128(_mm_and_si128(xmmMask2, _mm_loadu_si128((__m128i *)&d[x+4])), _mm_andnot_si128(xmmMask2, xmmPix2));
+		}
+		_mm_storeu_si128((__m128i *)&d[x], xmmPix);
+		_mm_storeu_si128((__m128i *)&d[x+4], xmmPix2);
+	}
+	PILGIFCompose32(&d[x], &s[x], iCount - x, pPalette, iTransparent);
+} /* PILGIFCompose32SSE2() */
+
+/****************************************************************************
+ *                                                                          *
+ *  FUNCTION   : PILGIFCompose16AVX2() / PILGIFCompose32AVX2()              *
+ *                                                                          *
+ *  PURPOSE    : AVX2 row kernels: palette lookups done with gathers.       *
+ *                                                                          *
+ ****************************************************************************/
+//
+// The RGB565 kernel gathers 32 bits at each 16-bit entry and keeps the low
+// half, so it reads one entry past the end of the table for index 255. Both
+// palettes PILAnimateGIFStart() hands out have room for that.
+//
+__attribute__((target("avx2")))
+static void PILGIFCompose16AVX2(void *pDest, unsigned char *s, int iCount, void *pPalette, int iTransparent)
+{
+unsigned short *d = (unsigned short *)pDest;
+__m128i xmmIdx;
+__m256i ymmIdx, ymmT, ymmMask, ymmLow, ymmLo, ymmHi, ymmPix;
+int x;
+unsigned int uMask;
+
+	ymmT = _mm256_set1_epi16((short)iTransparent);
+	ymmLow = _mm256_set1_epi32(0xffff);
+	for (x=0; x<iCount-15; x+=16)
+	{
+		xmmIdx = _mm_loadu_si128((__m128i *)&s[x]);
+		ymmIdx = _mm256_cvtepu8_epi16(xmmIdx);
+		ymmMask = _mm256_cmpeq_epi16(ymmIdx, ymmT);
+		uMask = (unsigned int)_mm256_movemask_epi8(ymmMask);
+		if (uMask == 0xffffffff) // all transparent
+			continue;
+		ymmLo = _mm256_i32gather_epi32((const int *)pPalette, _mm256_cvtepu8_epi32(xmmIdx), 2);
+		ymmHi = _mm256_i32gather_epi32((const int *)pPalette, _mm256_cvtepu8_epi32(_mm_srli_si128(xmmIdx, 8)), 2);
+		ymmPix = _mm256_packus_epi32(_mm256_and_si256(ymmLo, ymmLow), _mm256_and_si256(ymmHi, ymmLow));
+		ymmPix = _mm256_permute4x64_epi64(ymmPix, 0xd8); // packus works per 128-bit lane
+		if (uMask)
+			ymmPix = _mm256_blendv_epi8(ymmPix, _mm256_loadu_si256((__m256i *)&d[x]), ymmMask);
+		_mm256_storeu_si256((__m256i *)&d[x], ymmPix);
+	}
+	_mm256_zeroupper(); // the tail call isn't always given one, and SSE code after it would stall
+	PILGIFCompose16(&d[x], &s[x], iCount - x, pPalette, iTransparent);
+} /* PILGIFCompose16AVX2() */
+
+__attribute__((target("avx2")))
+static void PILGIFCompose32AVX2(void *pDest, unsigned char *s, int iCount, void *pPalette, int iTransparent)
+{
+uint32_t *d = (uint32_t *)pDest;
+__m256i ymmIdx, ymmT, ymmMask, ymmPix;
+int x;
+unsigned int uMask;
+
+	ymmT = _mm256_set1_epi32(iTransparent);
+	for (x=0; x<iCount-7; x+=8)
+	{
+		ymmIdx = _mm256_cvtepu8_epi32(_mm_loadl_epi64((__m128i *)&s[x]));
+		ymmMask = _mm256_cmpeq_epi32(ymmIdx, ymmT);
+		uMask = (unsigned int)_mm256_movemask_epi8(ymmMask);
+		if (uMask == 0xffffffff) // all transparent
+			continue;
+		ymmPix = _mm256_i32gather_epi32((const int *)pPalette, ymmIdx, 4);
+		if (uMask)
+			ymmPix = _mm256_blendv_epi8(ymmPix, _mm256_loadu_si256((__m256i *)&d[x]), ymmMask);
+		_mm256_storeu_si256((__m256i *)&d[x], ymmPix);
+	}
+	_mm256_zeroupper(); // the tail call isn't always given one, and SSE code after it would stall
+	PILGIFCompose32(&d[x], &s[x], iCount - x, pPalette, iTransparent);
+} /* PILGIFCompose32AVX2() */
+#endif // PIL_GIF_X86_SIMD
+
+/****************************************************************************
+ *                                                                          *
+ *  FUNCTION   : PILGIFPickCompose()                                        *
+ *                                                                          *
+ *  PURPOSE    : Choose the row kernel for the CPU and destination bpp.     *
+ *                                                                          *
+ ****************************************************************************/
+//
+// Checked on every frame rather than cached in a global so that several
+// animations can be started from different threads without a race.
+//
+static PILGIFCOMPOSE PILGIFPickCompose(int iBpp)
+{
+	if (iBpp != 16 && iBpp != 32)
+		return NULL;
+#ifdef PIL_GIF_X86_SIMD
+	if (__builtin_cpu_supports("avx2"))
+		return (iBpp == 16) ? PILGIFCompose16AVX2 : PILGIFCompose32AVX2;
+	if (__builtin_cpu_supports("sse2"))
+		return (iBpp == 16) ? PILGIFCompose16SSE2 : PILGIFCompose32SSE2;
+#endif
+	return (iBpp == 16) ? PILGIFCompose16 : PILGIFCompose32;
+} /* PILGIFPickCompose() */
+
+/****************************************************************************
+ *                                                                          *
+ *  FUNCTION   : PILAnimateGIFStart()                                       *
+ *                                                                          *
+ *  PURPOSE    : Prepare the palette and dispose of the previous frame      *
+ *               before a new frame is drawn on the animation page.         *
+ *                                                                          *
+ ****************************************************************************/
+int PILAnimateGIFStart(PIL_PAGE *pDestPage, PIL_PAGE *pSrcPage, PIL_GIF_ANIM *pAnim)
+{
+#ifndef JPEG_DECODE_ONLY
+
+unsigned char *s, *d;
+int x0, y0, x1, y1, y;
+int vx0, vy0, vx1, vy1; // visible part of the page
+int rx0, ry0, rx1, ry1; // visible part of the last frame
+int iBytes, iSize, iSavePitch;
+unsigned char ucDisposalFlags;
+unsigned char *pPalette;
+unsigned char ucPixel[4]; // background color in page format
+unsigned short usColor, *pusPalette;
+unsigned char *pucPalette = NULL;
+uint32_t ul;
+uint32_t *pulPalette = NULL;
+int iFormat;
+PIL_GIF_PALETTE *pPal;
+PIL_GIF_SAVE *pSave;
+
+   pusPalette = NULL;
+   if (pDestPage == NULL || pSrcPage == NULL || pAnim == NULL)
+	   return PIL_ERROR_INVPARAM;
+   if (pDestPage->pData == NULL || pDestPage->pPalette == NULL) // must have destination buffer & global color table
+	   return PIL_ERROR_INVPARAM;
+   iFormat = pDestPage->cGIFFormat;
+   switch (pDestPage->cBitsperpixel) // the format has to go with the bit depth
       {
-      if (s == linebuf) /* Houston, we have a problem */
-         {
-         return NULL; /* Exit with error */
-         }
-      *(--s) = (unsigned char)giftabs[CTLAST + code];
-      code = giftabs[CTLINK + code];
+      case 8:
+         if (iFormat != PIL_GIF_FORMAT_RGB332)
+            return PIL_ERROR_BITDEPTH;
+         break;
+      case 16:
+         if (iFormat != PIL_GIF_FORMAT_NATIVE && iFormat != PIL_GIF_FORMAT_RGB565_BE)
+            return PIL_ERROR_BITDEPTH;
+         break;
+      case 24:
+         if (iFormat != PIL_GIF_FORMAT_NATIVE && iFormat != PIL_GIF_FORMAT_RGB666)
+            return PIL_ERROR_BITDEPTH;
+         break;
+      case 32:
+         if (iFormat != PIL_GIF_FORMAT_NATIVE)
+            return PIL_ERROR_BITDEPTH;
+         break;
+      default:
+         return PIL_ERROR_BITDEPTH;
       }
-   iPixCount = (int)(intptr_t)(linebuf + 65536 - s);
+   if (pSrcPage->iX < 0 || pSrcPage->iY < 0 || (pSrcPage->iX + pSrcPage->iWidth) > pDestPage->iWidth || (pSrcPage->iY + pSrcPage->iHeight) > pDestPage->iHeight)
+         return PIL_ERROR_INVPARAM; // bad parameter
 
-   while (iPixCount && *y > 0)
+   pPal = pSrcPage->pGIFPalette;
+   if (pPal) // from the file's palette cache, converted once for all the frames that use it
+   {
+      pPalette = pPal->ucRGB;
+      if (pDestPage->cBitsperpixel == 16)
       {
-      if (*xcount > iPixCount)  /* Pixels fit completely on the line */
-         {
-         if (pPage->cBitsperpixel == 4 && bGIF)
-            {
-            k = pPage->iWidth - *xcount; /* Current x */
-            for (i=0; i < iPixCount; i++)
-               {
-               if ((k & 1) == 0)
-                  *buf = (*s++) << 4;
-               else
-                  *buf++ |= *s++;
-               k++;
-               }
-            }
-         else
-            {
-//            memcpy(buf, s, iPixCount);
-//            buf += iPixCount;
-            pEnd = buf + iPixCount;
-#ifdef _X86
-			while (buf < pEnd - 3) // at least 4 bytes to copy
+         if (!pPal->bHave16 || pPal->cFormat16 != iFormat)
+            PILGIFConvertPalette(pPalette, 16, iFormat, pPal->us565);
+         pPal->bHave16 = 1;
+         pPal->cFormat16 = (unsigned char)iFormat;
+         pusPalette = pPal->us565;
+      }
+      else if (pDestPage->cBitsperpixel == 32)
+      {
+         if (!pPal->bHave32)
+            PILGIFConvertPalette(pPalette, 32, iFormat, pPal->ul32);
+         pPal->bHave32 = 1;
+         pulPalette = pPal->ul32;
+      }
+      else if (pDestPage->cBitsperpixel == 8)
+      {
+         if (!pPal->bHave8)
+            PILGIFConvertPalette(pPalette, 8, iFormat, pPal->uc332);
+         pPal->bHave8 = 1;
+         pucPalette = pPal->uc332;
+      }
+      else if (iFormat == PIL_GIF_FORMAT_RGB666)
+      {
+         if (!pPal->bHave24)
+            PILGIFConvertPalette(pPalette, 24, iFormat, pPal->uc666);
+         pPal->bHave24 = 1;
+         pPalette = pPal->uc666;
+      }
+   }
+   else
+   {
+   pPalette = pAnim->ucPalette; // use global or local palette
+   memcpy(pPalette, pDestPage->pPalette, 768); // start with the global color table
+// get local color table changes (if present)
+   if (pSrcPage->pLocalPalette) // use local palette
+      memcpy(pPalette, pSrcPage->pLocalPalette, 768);
+   // Create a palette in the page's pixel format
+   if (pDestPage->cBitsperpixel == 16)
+      PILGIFConvertPalette(pPalette, 16, iFormat, pusPalette = (unsigned short *)&pPalette[1024]);
+   else if (pDestPage->cBitsperpixel == 32)
+      PILGIFConvertPalette(pPalette, 32, iFormat, pulPalette = (uint32_t *)&pPalette[1024]);
+   else if (pDestPage->cBitsperpixel == 8)
+      PILGIFConvertPalette(pPalette, 8, iFormat, pucPalette = &pPalette[1024]);
+   else if (iFormat == PIL_GIF_FORMAT_RGB666)
+      {
+      PILGIFConvertPalette(pPalette, 24, iFormat, &pPalette[1024]);
+      pPalette += 1024;
+      }
+   }
+
+// Dispose of the last frame according to the previous page disposal flags
+// (only the part that's visible)
+	PILGIFPageView(pDestPage, &vx0, &vy0, &vx1, &vy1);
+	rx0 = (pDestPage->iX > vx0) ? pDestPage->iX : vx0;
+	ry0 = (pDestPage->iY > vy0) ? pDestPage->iY : vy0;
+	rx1 = (pDestPage->iX + pDestPage->iCX < vx1) ? pDestPage->iX + pDestPage->iCX : vx1;
+	ry1 = (pDestPage->iY + pDestPage->iCY < vy1) ? pDestPage->iY + pDestPage->iCY : vy1;
+	if (rx1 < rx0)
+		rx1 = rx0;
+	ucDisposalFlags = (pDestPage->cGIFBits & 0x1c)>>2; // bits 2-4 = disposal flags
+	pDestPage->iDirtyCount = 0;
+	iBytes = pDestPage->cBitsperpixel >> 3;
+	switch (ucDisposalFlags)
+	{
+	case 0: // not specified - nothing to do
+	case 1: // do not dispose
+		break;
+	case 2: // restore to background color
+		PILGIFAddDirty(pDestPage, rx0, ry0, rx1, ry1);
+		if (pDestPage->cBackground == pDestPage->iTransparent) // transparent background, default to white
+		{
+			memset(ucPixel, (iFormat == PIL_GIF_FORMAT_RGB666) ? 0xfc : 0xff, sizeof(ucPixel));
+		}
+		else if (pDestPage->cBitsperpixel == 24)
+		{
+			memcpy(ucPixel, &pPalette[pDestPage->cBackground * 3], 3);
+		}
+		else if (pDestPage->cBitsperpixel == 8)
+		{
+			ucPixel[0] = pucPalette[pDestPage->cBackground];
+		}
+		else if (pDestPage->cBitsperpixel == 32)
+		{
+			ul = 0xff000000;
+			ul |= (pPalette[pDestPage->cBackground * 3]<<16);
+			ul |= (pPalette[(pDestPage->cBackground * 3) + 1]<<8);
+			ul |= pPalette[(pDestPage->cBackground * 3) + 2];
+			memcpy(ucPixel, &ul, 4);
+		}
+		else // 16bpp
+		{
+			usColor = pusPalette[pDestPage->cBackground];
+			memcpy(ucPixel, &usColor, 2);
+		}
+		PILGIFFillRect(pDestPage, rx0, ry0, rx1, ry1, ucPixel);
+		break;
+	case 3: // restore to previous frame
+		pSave = (PIL_GIF_SAVE *)pDestPage->lUser;
+		if (pSave) // if we saved it
+		{
+			// put back the part that was saved and is still visible
+			x0 = (rx0 > pSave->x0) ? rx0 : pSave->x0;
+			y0 = (ry0 > pSave->y0) ? ry0 : pSave->y0;
+			x1 = (rx1 < pSave->x1) ? rx1 : pSave->x1;
+			y1 = (ry1 < pSave->y1) ? ry1 : pSave->y1;
+			if (x1 > x0 && y1 > y0)
 			{
-				*(uint32_t *) buf = *(uint32_t *) s;
-				buf += 4; s += 4;
+				PILGIFAddDirty(pDestPage, x0, y0, x1, y1);
+				iSavePitch = (pSave->x1 - pSave->x0) * iBytes;
+				s = (unsigned char *)&pSave[1] + ((y0 - pSave->y0) * iSavePitch) + ((x0 - pSave->x0) * iBytes);
+				d = pDestPage->pData + (y0 * pDestPage->iPitch) + (x0 * iBytes);
+				for (y=y0; y<y1; y++)
+				{
+					memcpy(d, s, (x1 - x0) * iBytes);
+					s += iSavePitch;
+					d += pDestPage->iPitch;
+				}
 			}
+			pSave->x1 = pSave->x0; // only good for one restore
+		}
+		break;
+	default: // not defined
+		break;
+	}
+
+ // if this frame uses disposal method 3, we need to prepare for the next frame
+ // by saving what's under it before it gets modified. Only the visible part of
+ // the frame's rectangle is kept; the buffer grows to the largest one seen.
+	if (((pSrcPage->cGIFBits & 0x1c)>>2) == 3)
+	{
+		x0 = (pSrcPage->iX > vx0) ? pSrcPage->iX : vx0;
+		y0 = (pSrcPage->iY > vy0) ? pSrcPage->iY : vy0;
+		x1 = (pSrcPage->iX + pSrcPage->iWidth < vx1) ? pSrcPage->iX + pSrcPage->iWidth : vx1;
+		y1 = (pSrcPage->iY + pSrcPage->iHeight < vy1) ? pSrcPage->iY + pSrcPage->iHeight : vy1;
+		if (x1 < x0)
+			x1 = x0;
+		if (y1 < y0)
+			y1 = y0;
+		iSize = (x1 - x0) * iBytes * (y1 - y0);
+		pSave = (PIL_GIF_SAVE *)pDestPage->lUser;
+		if (pSave == NULL || pSave->iSize < iSize) // not allocated yet or too small
+		{
+			if (pSave)
+				PILIOFree(pSave);
+			pSave = (PIL_GIF_SAVE *)PILIOAlloc(sizeof(PIL_GIF_SAVE) + iSize);
+			pDestPage->lUser = (void *)pSave;
+			if (pSave == NULL)
+				return PIL_ERROR_MEMORY;
+			pSave->iSize = iSize;
+		}
+		pSave->x0 = x0;
+		pSave->y0 = y0;
+		pSave->x1 = x1;
+		pSave->y1 = y1;
+		iSavePitch = (x1 - x0) * iBytes;
+		s = pDestPage->pData + (y0 * pDestPage->iPitch) + (x0 * iBytes);
+		d = (unsigned char *)&pSave[1];
+		for (y=y0; y<y1; y++)
+		{
+			memcpy(d, s, iSavePitch);
+			s += pDestPage->iPitch;
+			d += iSavePitch;
+		}
+	}
+
+   pAnim->pDestPage = pDestPage;
+   pAnim->pSrcPage = pSrcPage;
+   pAnim->pPalette = pPalette;
+   pAnim->pusPalette = pusPalette;
+   pAnim->pulPalette = pulPalette;
+   pAnim->pucPalette = pucPalette;
+   pAnim->iSrcBpp = pSrcPage->cBitsperpixel;
+   // visible part of the new frame, in frame coordinates
+   pAnim->iVisX0 = (vx0 > pSrcPage->iX) ? vx0 - pSrcPage->iX : 0;
+   pAnim->iVisY0 = (vy0 > pSrcPage->iY) ? vy0 - pSrcPage->iY : 0;
+   pAnim->iVisX1 = (vx1 < pSrcPage->iX + pSrcPage->iWidth) ? vx1 - pSrcPage->iX : pSrcPage->iWidth;
+   pAnim->iVisY1 = (vy1 < pSrcPage->iY + pSrcPage->iHeight) ? vy1 - pSrcPage->iY : pSrcPage->iHeight;
+   if (pAnim->iVisX1 <= pAnim->iVisX0 || pAnim->iVisY1 <= pAnim->iVisY0) // frame is completely hidden
+      pAnim->iVisX0 = pAnim->iVisX1 = pAnim->iVisY0 = pAnim->iVisY1 = 0;
+   pAnim->bBounds = 0;
+   pAnim->iBoundX0 = pAnim->iBoundY0 = 0x7fffffff; // empty until something is drawn
+   pAnim->iBoundX1 = pAnim->iBoundY1 = 0;
+   if (pSrcPage->cGIFBits & 1) // if transparency used
+      pAnim->iTransparent = pSrcPage->iTransparent & 0xff;
+   else
+      pAnim->iTransparent = -1;
+   pAnim->pfnCompose = PILGIFPickCompose(pDestPage->cBitsperpixel);
+#endif // JPEG_DECODE_ONLY
+   return 0;
+} /* PILAnimateGIFStart() */
+
+/****************************************************************************
+ *                                                                          *
+ *  FUNCTION   : PILGIFDrawSpan()                                           *
+ *                                                                          *
+ *  PURPOSE    : Draw a run of indices onto the animation page.             *
+ *                                                                          *
+ ****************************************************************************/
+static void PILGIFDrawSpan(PIL_GIF_ANIM *pAnim, unsigned char *d, unsigned char *s, int iCount, int iTransparent)
+{
+unsigned char c, *pPalette;
+int x;
+
+	if (pAnim->pfnCompose) // RGB565 / ARGB
+	{
+		if (pAnim->pDestPage->cBitsperpixel == 16)
+			(*pAnim->pfnCompose)(d, s, iCount, pAnim->pusPalette, iTransparent);
+		else
+			(*pAnim->pfnCompose)(d, s, iCount, pAnim->pulPalette, iTransparent);
+		return;
+	}
+	if (pAnim->pDestPage->cBitsperpixel == 8) // RGB332
+	{
+		pPalette = pAnim->pucPalette;
+		for (x=0; x<iCount; x++)
+		{
+			c = s[x];
+			if (c != iTransparent)
+				d[x] = pPalette[c];
+		}
+		return;
+	}
+	pPalette = pAnim->pPalette; // 24bpp
+	for (x=0; x<iCount; x++)
+	{
+		c = s[x];
+		if (c != iTransparent)
+		{
+			d[0] = pPalette[c*3];
+			d[1] = pPalette[(c*3)+1];
+			d[2] = pPalette[(c*3)+2];
+		}
+		d += 3;
+	}
+} /* PILGIFDrawSpan() */
+
+/****************************************************************************
+ *                                                                          *
+ *  FUNCTION   : PILGIFSkipIndex()                                          *
+ *                                                                          *
+ *  PURPOSE    : Find the first pixel at or after i that isn't t.           *
+ *                                                                          *
+ ****************************************************************************/
+static int PILGIFSkipIndex(unsigned char *s, int i, int iCount, int t)
+{
+#if defined(PIL_GIF_X86_SIMD) && defined(__SSE2__)
+__m128i xmmT, xmmMask;
+int iMask;
+
+	xmmT = _mm_set1_epi8((char)t);
+	for (; i + 64 <= iCount; i += 64) // long runs 64 pixels per test
+	{
+		xmmMask = _mm_and_si128(_mm_cmpeq_epi8(_mm_loadu_si128((__m128i *)&s[i]), xmmT), _mm_cmpeq_epi8(_mm_loadu_si128((__m128i *)&s[i+16]), xmmT));
+		xmmMask = _mm_and_si128(xmmMask, _mm_cmpeq_epi8(_mm_loadu_si128((__m128i *)&s[i+32]), xmmT));
+		xmmMask = _mm_and_si128(xmmMask, _mm_cmpeq_epi8(_mm_loadu_si128((__m128i *)&s[i+48]), xmmT));
+		if (_mm_movemask_epi8(xmmMask) != 0xffff)
+			break;
+	}
+	for (; i + 16 <= iCount; i += 16)
+	{
+		iMask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((__m128i *)&s[i]), xmmT));
+		if (iMask != 0xffff)
+			return i + __builtin_ctz(~iMask);
+	}
+#else
+uint64_t u64Pattern, u64;
+
+	u64Pattern = 0x0101010101010101ULL * (unsigned char)t;
+	for (; i + 8 <= iCount; i += 8)
+	{
+		memcpy(&u64, &s[i], 8);
+		if (u64 != u64Pattern)
+			break;
+	}
 #endif
-			while (buf < pEnd)
-               {
-               *buf++ = *s++;
-               }
-            }
-         *xcount -= iPixCount;
-//         iPixCount = 0;
-         return buf;
-         }
-      else  /* Pixels cross into next line */
-         {
-         if (pPage->cBitsperpixel == 4 && bGIF)
-            {
-            k = pPage->iWidth - *xcount; /* Current x */
-            for (i=0; i < *xcount; i++)
-               {
-               if ((k & 1) == 0)
-                  *buf = (*s++) << 4;
-               else
-                  *buf++ |= *s++;
-               k++;
-               }
-            }
-         else
-            {
-//            memcpy(buf, s, *xcount);
-//            buf += *xcount;
-//            s += *xcount;
-            pEnd = buf + *xcount;
-            while (buf < pEnd)
-               {
-               *buf++ = *s++;
-               }
-            }
-         iPixCount -= *xcount;
-         if (!bGIF)
-            {
-            if (pPage->cFlags & PIL_PAGEFLAGS_PLANAR) // planar data treated differently
-               *xcount = pPage->iWidth;
-            else
-               *xcount = PILCalcBSize(pPage->iWidth, pPage->cBitsperpixel);
-            }
-         else
-            *xcount = pPage->iWidth; /* Reset pixel count */
-         if (bGIF)
-            buf += lsize - PILCalcBSize(pPage->iWidth, pPage->cBitsperpixel); /* Advance to next line */
-         if (pPage->cBitsperpixel == 4 && bGIF && (pPage->iWidth & 1) == 1)
-            buf++;
-         (*y)--;
-         }
-      } /* while */
-   return buf;
-} /* PILMakeGifPels() */
+	while (i < iCount && s[i] == t)
+		i++;
+	return i;
+} /* PILGIFSkipIndex() */
 
-#define SYM_OFFSETS 0x0000
-#define SYM_LENGTHS 0x1000
-#define SYM_EXTRAS  0x2000
+/****************************************************************************
+ *                                                                          *
+ *  FUNCTION   : PILGIFSpanEnd()                                            *
+ *                                                                          *
+ *  PURPOSE    : Find where a span of mostly opaque pixels ends.            *
+ *                                                                          *
+ ****************************************************************************/
+//
+// The span runs until a block of 16 (8 without SSE2) pixels which are all
+// t, so short transparent gaps stay inside it for the kernel to mask.
+//
+static int PILGIFSpanEnd(unsigned char *s, int i, int iCount, int t)
+{
+#if defined(PIL_GIF_X86_SIMD) && defined(__SSE2__)
+__m128i xmmT;
+
+	xmmT = _mm_set1_epi8((char)t);
+	for (; i + 16 <= iCount; i += 16)
+	{
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((__m128i *)&s[i]), xmmT)) == 0xffff)
+			return i;
+	}
+#else
+uint64_t u64Pattern, u64;
+
+	u64Pattern = 0x0101010101010101ULL * (unsigned char)t;
+	for (; i + 8 <= iCount; i += 8)
+	{
+		memcpy(&u64, &s[i], 8);
+		if (u64 == u64Pattern)
+			return i;
+	}
+#endif
+	return iCount;
+} /* PILGIFSpanEnd() */
 
 /****************************************************************************
  *                                                                          *
- *  FUNCTION   : LZWCopyBytes()                                             *
+ *  FUNCTION   : PILGIFDrawIndices()                                        *
  *                                                                          *
- *  PURPOSE    : Output the bytes for a single code (checks for buffer len) *
+ *  PURPOSE    : Draw the opaque spans of a run of frame pixels.            *
+ *                                                                          *
+ ****************************************************************************/
+//
+// x, y are the page coordinates of s[0]. Transparent runs are skipped a
+// block at a time; whatever is between them is trimmed to its first and
+// last opaque pixel and drawn as one span.
+// What's drawn is added to the frame's bounding box (iBoundX0...).
+//
+static void PILGIFDrawIndices(PIL_GIF_ANIM *pAnim, int x, int y, unsigned char *s, int iCount)
+{
+PIL_PAGE *pDestPage = pAnim->pDestPage;
+unsigned char *d;
+int i, iEnd, iFirst, iLast, iBytes, t;
+
+	iBytes = pDestPage->cBitsperpixel >> 3;
+	d = pDestPage->pData + (pDestPage->iPitch * y) + (x * iBytes);
+	t = pAnim->iTransparent;
+	if (t < 0) // every pixel is drawn
+	{
+		PILGIFDrawSpan(pAnim, d, s, iCount, -1);
+		iFirst = 0;
+		iLast = iCount;
+	}
+	else
+	{
+		iFirst = iCount;
+		iLast = 0;
+		for (i=0; ; i=iEnd)
+		{
+			i = PILGIFSkipIndex(s, i, iCount, t);
+			if (i >= iCount)
+				break;
+			iEnd = PILGIFSpanEnd(s, i, iCount, t);
+			while (s[iEnd-1] == t) // s[i] is opaque, so this stops there
+				iEnd--;
+			PILGIFDrawSpan(pAnim, d + (i * iBytes), &s[i], iEnd - i, t);
+			if (i < iFirst)
+				iFirst = i;
+			iLast = iEnd;
+		}
+	}
+	if (iLast <= iFirst) // all transparent
+		return;
+	if (x + iFirst < pAnim->iBoundX0)
+		pAnim->iBoundX0 = x + iFirst;
+	if (x + iLast > pAnim->iBoundX1)
+		pAnim->iBoundX1 = x + iLast;
+	if (y < pAnim->iBoundY0)
+		pAnim->iBoundY0 = y;
+	if (y + 1 > pAnim->iBoundY1)
+		pAnim->iBoundY1 = y + 1;
+} /* PILGIFDrawIndices() */
+
+/****************************************************************************
+ *                                                                          *
+ *  FUNCTION   : PILAnimateGIFLine()                                        *
+ *                                                                          *
+ *  PURPOSE    : Draw one row of the new frame onto the animation page.     *
+ *                                                                          *
+ ****************************************************************************/
+//
+// y is the row within the frame. The prototype matches PILGIFROW so this
+// can be handed straight to PILDecodeGIFRows() with a PIL_GIF_ANIM.
+//
+void PILAnimateGIFLine(void *pUser, int y, unsigned char *s, int iWidth)
+{
+#ifndef JPEG_DECODE_ONLY
+PIL_GIF_ANIM *pAnim = (PIL_GIF_ANIM *)pUser;
+PIL_PAGE *pSrcPage = pAnim->pSrcPage;
+unsigned char c, *p;
+unsigned char ucIndex[256]; // 4-bpp pixels unpacked a piece at a time
+int x, x0, x1, i, iCount;
+
+   pAnim->bBounds = 1; // the frame's bounding box comes from the rows drawn
+   if (y < pAnim->iVisY0 || y >= pAnim->iVisY1)
+      return; // row isn't visible
+   // only draw the visible columns
+   x0 = pAnim->iVisX0;
+   x1 = pAnim->iVisX1;
+   if (x1 > iWidth)
+      x1 = iWidth;
+   if (x1 <= x0)
+      return;
+   if (pAnim->iSrcBpp == 8)
+      {
+      PILGIFDrawIndices(pAnim, pSrcPage->iX + x0, pSrcPage->iY + y, s + x0, x1 - x0);
+      return;
+      }
+   // 4-bpp: unpack the nibbles and draw them the same way
+   for (x=x0; x<x1; x+=iCount)
+      {
+      iCount = x1 - x;
+      if (iCount > (int)sizeof(ucIndex))
+         iCount = sizeof(ucIndex);
+      p = s + (x >> 1);
+      i = 0;
+      if (x & 1)
+         ucIndex[i++] = *p++ & 0xf;
+      for (; i<iCount-1; i+=2)
+         {
+         c = *p++;
+         ucIndex[i] = c >> 4;
+         ucIndex[i+1] = c & 0xf;
+         }
+      if (i < iCount)
+         ucIndex[i] = *p >> 4;
+      PILGIFDrawIndices(pAnim, pSrcPage->iX + x, pSrcPage->iY + y, ucIndex, iCount);
+      }
+#endif // JPEG_DECODE_ONLY
+} /* PILAnimateGIFLine() */
+
+/****************************************************************************
+ *                                                                          *
+ *  FUNCTION   : PILAnimateGIFEnd()                                         *
+ *                                                                          *
+ *  PURPOSE    : Finish drawing a frame onto the animation page.            *
+ *                                                                          *
+ ****************************************************************************/
+void PILAnimateGIFEnd(PIL_GIF_ANIM *pAnim)
+{
+PIL_PAGE *pDestPage = pAnim->pDestPage;
+PIL_PAGE *pSrcPage = pAnim->pSrcPage;
+
+// The frame changed the pixels PILAnimateGIFLine() drew; when it was decoded
+// straight onto the page that isn't known, so it's the whole visible frame
+   if (pAnim->bBounds)
+      PILGIFAddDirty(pDestPage, pAnim->iBoundX0, pAnim->iBoundY0, pAnim->iBoundX1, pAnim->iBoundY1);
+   else
+      PILGIFAddDirty(pDestPage, pSrcPage->iX + pAnim->iVisX0, pSrcPage->iY + pAnim->iVisY0, pSrcPage->iX + pAnim->iVisX1, pSrcPage->iY + pAnim->iVisY1);
+// need to hold last frame info for posible "disposition" on the next frame
+   pDestPage->cGIFBits = pSrcPage->cGIFBits;
+   pDestPage->iFrameDelay = pSrcPage->iFrameDelay;
+   pDestPage->iX = pSrcPage->iX;
+   pDestPage->iY = pSrcPage->iY;
+   pDestPage->iCX = pSrcPage->iWidth;
+   pDestPage->iCY = pSrcPage->iHeight;
+} /* PILAnimateGIFEnd() */
+
+/****************************************************************************
+ *                                                                          *
+ *  FUNCTION   : PILAnimateGIF()                                            *
+ *                                                                          *
+ *  PURPOSE    : BitBlt the new data onto the old page for animation (GIF). *
+ *                                                                          *
+ ****************************************************************************/
+int PILAnimateGIF(PIL_PAGE *pDestPage, PIL_PAGE *pSrcPage)
+{
+PIL_GIF_ANIM anim;
+int y, iErr;
+
+   if (pSrcPage == NULL || pSrcPage->pData == NULL)
+	   return PIL_ERROR_INVPARAM;
+   iErr = PILAnimateGIFStart(pDestPage, pSrcPage, &anim);
+   if (iErr)
+      return iErr;
+   for (y=anim.iVisY0; y<anim.iVisY1; y++)
+      {
+      PILAnimateGIFLine(&anim, y, pSrcPage->pData + (y * pSrcPage->iPitch), pSrcPage->iWidth);
+      }
+   PILAnimateGIFEnd(&anim);
+   return 0;
+
+} /* PILAnimateGIF() */
+
+/****************************************************************************
+ *                                                                          *
+ *  FUNCTION   : PILMakeGifPels(signed short *, unsigned char *, short, int *) *
+ *                                                                          *
+ *  PURPOSE    : Convert a linked list of codes into pixel data (TIFF).     *
+ *                                                                          *
+ ****************************************************************************/
+unsigned char *PILMakeGifPels(unsigned short *giftabs, unsigned char *templine, unsigned char *linebuf, unsigned int code, int *xcount, unsigned char *buf, int *y, PIL_PAGE *pPage, unsigned char **irlcptr)
+{
+int iPixCount;
+unsigned char *s, *pEnd;
+//unsigned char **index = NULL;
+
+//   if (pPage->cBitsperpixel == 1)
+//      index = (unsigned char **)pPage->pData;
+
+   /* Copy this string of sequential pixels to output buffer */
+//   iPixCount = 0;
+   s = linebuf + 65536; /* Pixels will come out in reversed order */
+
+   while (code < CT_OLD)
+      {
+      if (s == linebuf) /* Houston, we have a problem */
+         {
+         return NULL; /* Exit with error */
+         }
+      *(--s) = (unsigned char)giftabs[CTLAST + code];
+      code = giftabs[CTLINK + code];
+      }
+   iPixCount = (int)(intptr_t)(linebuf + 65536 - s);
+
+   while (iPixCount && *y > 0)
+      {
+      if (*xcount > iPixCount)  /* Pixels fit completely on the line */
+         {
+//         memcpy(buf, s, iPixCount);
+//         buf += iPixCount;
+         pEnd = buf + iPixCount;
+#ifdef _X86
+         while (buf < pEnd - 3) // at least 4 bytes to copy
+            {
+            *(uint32_t *) buf = *(uint32_t *) s;
+            buf += 4; s += 4;
+            }
+#endif
+         while (buf < pEnd)
+            {
+            *buf++ = *s++;
+            }
+         *xcount -= iPixCount;
+//         iPixCount = 0;
+         return buf;
+         }
+      else  /* Pixels cross into next line */
+         {
+//         memcpy(buf, s, *xcount);
+//         buf += *xcount;
+//         s += *xcount;
+         pEnd = buf + *xcount;
+         while (buf < pEnd)
+            {
+            *buf++ = *s++;
+            }
+         iPixCount -= *xcount;
+         if (pPage->cFlags & PIL_PAGEFLAGS_PLANAR) // planar data treated differently
+            *xcount = pPage->iWidth;
+         else
+            *xcount = PILCalcBSize(pPage->iWidth, pPage->cBitsperpixel);
+         (*y)--;
+         }
+      } /* while */
+   return buf;
+} /* PILMakeGifPels() */
+
+#define SYM_OFFSETS 0x0000
+#define SYM_LENGTHS 0x1000
+#define SYM_EXTRAS  0x2000
+
+/****************************************************************************
+ *                                                                          *
+ *  FUNCTION   : LZWCopyBytes()                                             *
+ *                                                                          *
+ *  PURPOSE    : Output the bytes for a single code (checks for buffer len) *
+ *                                                                          *
+ ****************************************************************************/
+int LZWCopyBytes(unsigned char *buf, int iOffset, int iUncompressedLen, uint32_t *pSymbols)
+{
+int iLen;
+unsigned char *s, *d;
+#ifdef _X86
+int iTempLen;
+#else
+unsigned char *pEnd;
+#endif
+
+    iLen = pSymbols[SYM_LENGTHS];
+    // Make sure data does not write past end of buffer (which does occur frequently)
+    if (iLen > (iUncompressedLen - iOffset))
+       iLen = iUncompressedLen - iOffset;
+    s = &buf[pSymbols[SYM_OFFSETS]];
+    d = &buf[iOffset];
+#ifdef _X86
+	iTempLen = iLen;
+	while (iTempLen > 0) // most frequent are 1-3 bytes in length, copy 4 bytes in these cases too
+	{
+		*(uint32_t *)d = *(uint32_t *) s;
+		d += 4; s += 4;
+		iTempLen -= 4;
+	}
+	d += iTempLen; // in case we overshot
+#else
+	pEnd = &d[iLen];
+	while (d < pEnd)
+       *d++ = *s++;
+#endif
+	if (pSymbols[SYM_EXTRAS] != -1) // was a newly used code
+	{
+		*d = buf[pSymbols[SYM_EXTRAS]];
+		iLen++;
+		// since the code with extension byte has now been written to the output, fix the code
+		pSymbols[SYM_OFFSETS] = iOffset;
+		pSymbols[SYM_EXTRAS] = 0xffffffff;
+		pSymbols[SYM_LENGTHS]++;
+//		pSymbols[SYM_LENGTHS] = iLen; - this is slower on x86, but faster on ARM
+	}
+    return iLen;
+
+} /* LZWCopyBytes() */
+
+//
+// GIF codes are packed LSB first. The reader keeps 57-64 valid bits in a
+// 64-bit accumulator, so 4 or more codes come out of every refill. Within 8
+// bytes of the end of the data it falls back to single bytes; it never reads
+// past pEnd, so the input doesn't need any padding.
+//
+static uint64_t PILGIFLoad64(unsigned char *p)
+{
+uint64_t u;
+
+	memcpy(&u, p, sizeof(u)); // compiles to a single (unaligned-safe) load
+	return u;
+} /* PILGIFLoad64() */
+
+#define GIFBITS_REFILL(ulBits, iBitCount, s, pEnd) \
+	if ((pEnd) - (s) >= 8) \
+	{ (ulBits) |= PILGIFLoad64(s) << (iBitCount); \
+	  (s) += (63 - (iBitCount)) >> 3; \
+	  (iBitCount) |= 56; } \
+	else \
+	{ while ((iBitCount) <= 56 && (s) < (pEnd)) \
+		{ (ulBits) |= (uint64_t)(*(s)++) << (iBitCount); (iBitCount) += 8; } }
+
+// Sub-block mode: what's left of the current sub-block in this push
+#define GIFBITS_START(pLZW, pData, iLen, pEnd, pDataEnd, iBlockRest) \
+	(pDataEnd) = &(pData)[iLen]; \
+	if ((pLZW)->bSubBlocks) \
+	{ (iBlockRest) = ((pLZW)->iBlockLeft < (iLen)) ? (pLZW)->iBlockLeft : (iLen); \
+	  (pEnd) = &(pData)[iBlockRest]; \
+	  (iBlockRest) = (pLZW)->iBlockLeft - (iBlockRest); } \
+	else \
+	{ (pEnd) = (pDataEnd); (iBlockRest) = 0; }
+
+// Still short of a code after GIFBITS_REFILL(): the sub-block (or the data)
+// is used up. In sub-block mode step over the next length byte and carry on,
+// a code's bits run straight across it. Goes to lExit when more data is
+// needed and to lEnd at the block terminator.
+#define GIFBITS_NEXTBLOCK(pLZW, ulBits, iBitCount, iNeed, s, pEnd, pDataEnd, iBlockRest, lExit, lEnd) \
+	while ((iBitCount) < (iNeed)) \
+	{ if (!(pLZW)->bSubBlocks || (iBlockRest) != 0 || (s) >= (pDataEnd)) goto lExit; \
+	  (iBlockRest) = *(s)++; \
+	  if ((iBlockRest) == 0) goto lEnd; \
+	  (pEnd) = ((pDataEnd) - (s) < (iBlockRest)) ? (pDataEnd) : &(s)[iBlockRest]; \
+	  (iBlockRest) -= (int)((pEnd) - (s)); \
+	  GIFBITS_REFILL(ulBits, iBitCount, s, pEnd); }
+
+// Row mode string table entry: prefix code, first pixel and last pixel
+#define GIF_ROW_LINK(prefix, first, suffix) ((uint32_t)(prefix) | ((uint32_t)(first) << 16) | ((uint32_t)(suffix) << 24))
+// Canvas mode: string length flag for strings holding the transparent index
+#define GIF_LEN_TRANSPARENT 0x80000000
+#define GIF_NO_POS 0xffffffff
+// Decode loops are written once and compiled separately for each set of
+// constant arguments (output format, transparency)
+#if defined(_MSC_VER)
+#define PIL_GIF_KERNEL static __forceinline
+#elif defined(__GNUC__)
+#define PIL_GIF_KERNEL static inline __attribute__((always_inline))
+#else
+#define PIL_GIF_KERNEL static
+#endif
+static int PILGIFPushForward(PIL_GIF_LZW *pLZW, unsigned char *pData, int iLen);
+static int PILGIFPushRow8(PIL_GIF_LZW *pLZW, unsigned char *pData, int iLen);
+static int PILGIFPushFrame8(PIL_GIF_LZW *pLZW, unsigned char *pData, int iLen);
+static int PILGIFPushCanvas16(PIL_GIF_LZW *pLZW, unsigned char *pData, int iLen);
+static int PILGIFPushCanvas16T(PIL_GIF_LZW *pLZW, unsigned char *pData, int iLen);
+static int PILGIFPushCanvas32(PIL_GIF_LZW *pLZW, unsigned char *pData, int iLen);
+static int PILGIFPushCanvas32T(PIL_GIF_LZW *pLZW, unsigned char *pData, int iLen);
+
+/****************************************************************************
+ *                                                                          *
+ *  FUNCTION   : PILGIFPack4()                                              *
+ *                                                                          *
+ *  PURPOSE    : Pack 8-bit GIF pixels (values < 16) into 4-bpp rows.       *
+ *                                                                          *
+ ****************************************************************************/
+void PILGIFPack4(unsigned char *pSrc, unsigned char *pDest, int iWidth, int iHeight, int lsize)
+{
+int x, y;
+unsigned char *s, *d;
+
+	for (y = 0; y < iHeight; y++)
+	{
+		s = &pSrc[y * iWidth];
+		d = &pDest[y * lsize];
+		for (x = 0; x < iWidth - 1; x += 2)
+		{
+			*d++ = (s[0] << 4) | s[1];
+			s += 2;
+		}
+		if (iWidth & 1)
+			*d = s[0] << 4;
+	}
+} /* PILGIFPack4() */
+
+/****************************************************************************
+ *                                                                          *
+ *  FUNCTION   : PILGIFLZWCreate()                                          *
+ *                                                                          *
+ *  PURPOSE    : Allocate a GIF LZW decoder context.                        *
+ *                                                                          *
+ ****************************************************************************/
+//
+// A context can be kept for the life of the program and used for every
+// frame of every file (set PIL_FILE.pGIFLZW), so decoding a frame doesn't
+// have to allocate anything. Nothing in it needs to be cleared between
+// frames; codes are only trusted up to nextcode.
+//
+PIL_GIF_LZW * PILGIFLZWCreate(void)
+{
+PIL_GIF_LZW *pLZW;
+
+	pLZW = (PIL_GIF_LZW *) PILIOAllocNoClear(sizeof(PIL_GIF_LZW));
+	if (pLZW != NULL)
+	{
+		pLZW->pScratch = NULL;
+		pLZW->iScratchSize = 0;
+		pLZW->pRow = NULL;
+		pLZW->bDone = TRUE;
+	}
+	return pLZW;
+} /* PILGIFLZWCreate() */
+
+/****************************************************************************
+ *                                                                          *
+ *  FUNCTION   : PILGIFLZWDestroy()                                         *
+ *                                                                          *
+ *  PURPOSE    : Free a GIF LZW decoder context.                            *
+ *                                                                          *
+ ****************************************************************************/
+void PILGIFLZWDestroy(PIL_GIF_LZW *pLZW)
+{
+	if (pLZW == NULL)
+		return;
+	PILIOFree(pLZW->pScratch);
+	PILIOFree(pLZW);
+} /* PILGIFLZWDestroy() */
+
+/****************************************************************************
+ *                                                                          *
+ *  FUNCTION   : PILGIFLZWScratch()                                         *
+ *                                                                          *
+ *  PURPOSE    : Return the context's work buffer, growing it if needed.    *
+ *                                                                          *
+ ****************************************************************************/
+unsigned char * PILGIFLZWScratch(PIL_GIF_LZW *pLZW, int iSize)
+{
+	if (iSize > pLZW->iScratchSize)
+	{
+		PILIOFree(pLZW->pScratch);
+		pLZW->pScratch = (unsigned char *) PILIOAlloc(iSize);
+		pLZW->iScratchSize = (pLZW->pScratch) ? iSize : 0;
+	}
+	return pLZW->pScratch;
+} /* PILGIFLZWScratch() */
+
+/****************************************************************************
+ *                                                                          *
+ *  FUNCTION   : PILGIFLZWInit()                                            *
+ *                                                                          *
+ *  PURPOSE    : Prepare a GIF LZW decoder state for a new frame.           *
+ *                                                                          *
+ ****************************************************************************/
+int PILGIFLZWInit(PIL_GIF_LZW *pLZW, int iCodeStart, unsigned char *pOut, int iSize)
+{
+	if (iCodeStart < 2 || iCodeStart > 8)
+		return PIL_ERROR_DECOMP;
+	pLZW->ulBits = 0;
+	pLZW->iBitCount = 0;
+	pLZW->iOffset = 0;
+	pLZW->iSize = iSize;
+	pLZW->iOldOffset = pLZW->iOldLen = 0;
+	pLZW->pOut = pOut;
+	pLZW->codestart = (unsigned short)iCodeStart;
+	pLZW->cc = 1 << iCodeStart; /* Clear code */
+	pLZW->eoi = pLZW->cc + 1;
+	pLZW->codesize = iCodeStart + 1;
+	pLZW->sMask = (1 << pLZW->codesize) - 1;
+	pLZW->nextcode = pLZW->cc + 2;
+	pLZW->nextlim = 1 << pLZW->codesize;
+	pLZW->oldcode = CT_END;
+	pLZW->bDone = FALSE;
+	pLZW->bSubBlocks = FALSE;
+	pLZW->iBlockLeft = 0;
+	pLZW->pfnRow = NULL;
+	pLZW->pRow = NULL; // whole frame goes to pOut in stream order
+	pLZW->pfnPush = PILGIFPushForward;
+	return 0;
+} /* PILGIFLZWInit() */
+
+/****************************************************************************
+ *                                                                          *
+ *  FUNCTION   : PILGIFLZWInitRows()                                        *
+ *                                                                          *
+ *  PURPOSE    : Prepare a GIF LZW decoder state to deliver a frame one     *
+ *               row at a time.                                             *
+ *                                                                          *
+ ****************************************************************************/
+//
+// With iPitch == 0, pRow is a single row that's reused for every row of the
+// frame and pfnRow must consume it. Otherwise pRow is the top of a frame
+// buffer with iPitch bytes per row, each row is written straight to its
+// final position (also when interlaced) and pfnRow is optional.
+//
+int PILGIFLZWInitRows(PIL_GIF_LZW *pLZW, int iCodeStart, int iWidth, int iHeight, PILBOOL bInterlaced, unsigned char *pRow, int iPitch, PILGIFROW pfnRow, void *pUser)
+{
+int i, iErr;
+
+	if (iWidth <= 0 || iHeight <= 0 || pRow == NULL || (pfnRow == NULL && iPitch == 0))
+		return PIL_ERROR_INVPARAM;
+	iErr = PILGIFLZWInit(pLZW, iCodeStart, NULL, iWidth * iHeight);
+	if (iErr)
+		return iErr;
+	pLZW->pfnRow = pfnRow;
+	pLZW->pUser = pUser;
+	pLZW->pRow = pLZW->pFrame = pRow;
+	pLZW->iPitch = iPitch;
+	pLZW->iWidth = iWidth;
+	pLZW->iHeight = iHeight;
+	pLZW->iX = pLZW->iY = 0;
+	pLZW->iRowCount = 0;
+	pLZW->iPass = (bInterlaced) ? 0 : -1;
+	pLZW->iVisX0 = pLZW->iVisY0 = pLZW->iRowX0 = 0; // the whole frame is visible
+	pLZW->iVisX1 = pLZW->iRowX1 = iWidth;
+	pLZW->iVisY1 = iHeight;
+	pLZW->pfnPush = (iPitch) ? PILGIFPushFrame8 : PILGIFPushRow8;
+	pLZW->iTransparent = -1;
+	pLZW->iOldOffset = -1; // no previous string written yet
+	for (i=0; i<pLZW->cc; i++) // root codes are their own first and last pixel
+	{
+		pLZW->u32Offsets[i] = GIF_ROW_LINK(i, i, i);
+		pLZW->u32Lengths[i] = 1;
+	}
+	return 0;
+} /* PILGIFLZWInitRows() */
+
+/****************************************************************************
+ *                                                                          *
+ *  FUNCTION   : PILGIFLZWInitCanvas()                                      *
+ *                                                                          *
+ *  PURPOSE    : Prepare a GIF LZW decoder state to draw a frame straight   *
+ *               onto a 16 or 32-bpp canvas.                                *
+ *                                                                          *
+ ****************************************************************************/
+//
+// pCanvas points to the frame's top left pixel on the canvas. Each decoded
+// index is looked up in pPalette (RGB565 or ARGB) as it's emitted; pixels
+// equal to iTransparent (if >= 0) keep what's already on the canvas.
+//
+int PILGIFLZWInitCanvas(PIL_GIF_LZW *pLZW, int iCodeStart, int iWidth, int iHeight, PILBOOL bInterlaced, unsigned char *pCanvas, int iPitch, int iBpp, void *pPalette, int iTransparent)
+{
+int iErr;
+
+	if ((iBpp != 16 && iBpp != 32) || pPalette == NULL || iPitch == 0)
+		return PIL_ERROR_INVPARAM;
+	iErr = PILGIFLZWInitRows(pLZW, iCodeStart, iWidth, iHeight, bInterlaced, pCanvas, iPitch, NULL, NULL);
+	if (iErr)
+		return iErr;
+	if (iBpp == 16)
+		pLZW->pfnPush = (iTransparent >= 0) ? PILGIFPushCanvas16T : PILGIFPushCanvas16;
+	else
+		pLZW->pfnPush = (iTransparent >= 0) ? PILGIFPushCanvas32T : PILGIFPushCanvas32;
+	pLZW->pCanvasPalette = pPalette;
+	pLZW->iTransparent = iTransparent;
+	if (iTransparent >= 0 && iTransparent < pLZW->cc)
+		pLZW->u32Lengths[iTransparent] |= GIF_LEN_TRANSPARENT;
+	return 0;
+} /* PILGIFLZWInitCanvas() */
+
+/****************************************************************************
+ *                                                                          *
+ *  FUNCTION   : PILGIFRowView()                                            *
+ *                                                                          *
+ *  PURPOSE    : Set the visible columns of the current row.                *
+ *                                                                          *
+ ****************************************************************************/
+static void PILGIFRowView(PIL_GIF_LZW *pLZW)
+{
+	if (pLZW->iY >= pLZW->iVisY0 && pLZW->iY < pLZW->iVisY1)
+	{
+		pLZW->iRowX0 = pLZW->iVisX0;
+		pLZW->iRowX1 = pLZW->iVisX1;
+	}
+	else // nothing in this row is visible, x < iRowX1 is never true
+		pLZW->iRowX0 = pLZW->iRowX1 = 0;
+} /* PILGIFRowView() */
+
+/****************************************************************************
+ *                                                                          *
+ *  FUNCTION   : PILGIFLZWSetView()                                         *
+ *                                                                          *
+ *  PURPOSE    : Limit the pixels written in row and canvas mode.           *
+ *                                                                          *
+ ****************************************************************************/
+//
+// Call after PILGIFLZWInitRows()/PILGIFLZWInitCanvas(). x0,y0 - x1,y1 (not
+// inclusive) is the part of the frame that can be seen. The whole code
+// stream is still decoded, but strings that land completely outside of it
+// aren't written and hidden rows aren't passed to pfnRow. Strings that are
+// partly visible are written in full, so the frame buffer must still cover
+// the whole frame.
+//
+void PILGIFLZWSetView(PIL_GIF_LZW *pLZW, int x0, int y0, int x1, int y1)
+{
+	if (x0 < 0) x0 = 0;
+	if (y0 < 0) y0 = 0;
+	if (x1 > pLZW->iWidth) x1 = pLZW->iWidth;
+	if (y1 > pLZW->iHeight) y1 = pLZW->iHeight;
+	if (x1 <= x0 || y1 <= y0) // nothing visible
+		x0 = x1 = y0 = y1 = 0;
+	pLZW->iVisX0 = x0;
+	pLZW->iVisX1 = x1;
+	pLZW->iVisY0 = y0;
+	pLZW->iVisY1 = y1;
+	PILGIFRowView(pLZW);
+} /* PILGIFLZWSetView() */
+
+/****************************************************************************
+ *                                                                          *
+ *  FUNCTION   : PILGIFRowDone()                                            *
+ *                                                                          *
+ *  PURPOSE    : Hand the finished row to the caller and move to the next   *
+ *               one. Returns TRUE when the frame is complete.              *
+ *                                                                          *
+ ****************************************************************************/
+PILBOOL PILGIFRowDone(PIL_GIF_LZW *pLZW)
+{
+	if (pLZW->pfnRow && pLZW->iRowX1 > pLZW->iRowX0) // hidden rows aren't passed on
+		(*pLZW->pfnRow)(pLZW->pUser, pLZW->iY, pLZW->pRow, pLZW->iWidth);
+	pLZW->iRowCount++;
+	if (pLZW->iPass < 0)
+		pLZW->iY++;
+	else
+	{
+		pLZW->iY += cGIFPass[pLZW->iPass * 2];
+		while (pLZW->iY >= pLZW->iHeight && pLZW->iPass < 3)
+		{
+			pLZW->iPass++;
+			pLZW->iY = cGIFPass[pLZW->iPass * 2 + 1];
+		}
+	}
+	if (pLZW->iPitch && pLZW->iY < pLZW->iHeight)
+		pLZW->pRow = pLZW->pFrame + (pLZW->iY * pLZW->iPitch);
+	PILGIFRowView(pLZW);
+	return (pLZW->iRowCount >= pLZW->iHeight);
+} /* PILGIFRowDone() */
+
+/****************************************************************************
+ *                                                                          *
+ *  FUNCTION   : PILGIFPutPixels()                                          *
+ *                                                                          *
+ *  PURPOSE    : Write a run of palette indices to the row, as indices or   *
+ *               as canvas colors.                                          *
+ *                                                                          *
+ ****************************************************************************/
+PIL_GIF_KERNEL void PILGIFPutPixels(PIL_GIF_LZW *pLZW, unsigned char *pDest, unsigned char *s, int n, const int iPixelShift, const PILBOOL bTransparent)
+{
+unsigned short *ds, *pusPalette;
+uint32_t *pul, *pulPalette;
+unsigned char c, *pEnd;
+int iTransparent;
+
+	pEnd = &s[n];
+	iTransparent = pLZW->iTransparent;
+	if (iPixelShift == 0) // indices
+	{
+		memcpy(pDest, s, n);
+	}
+	else if (iPixelShift == 1) // RGB565
+	{
+		ds = (unsigned short *)pDest;
+		pusPalette = (unsigned short *)pLZW->pCanvasPalette;
+		while (s < pEnd)
+		{
+			c = *s++;
+			if (!bTransparent || c != iTransparent)
+				*ds = pusPalette[c];
+			ds++;
+		}
+	}
+	else // ARGB
+	{
+		pul = (uint32_t *)pDest;
+		pulPalette = (uint32_t *)pLZW->pCanvasPalette;
+		while (s < pEnd)
+		{
+			c = *s++;
+			if (!bTransparent || c != iTransparent)
+				*pul = pulPalette[c];
+			pul++;
+		}
+	}
+} /* PILGIFPutPixels() */
+
+/****************************************************************************
+ *                                                                          *
+ *  FUNCTION   : PILGIFRowKernel()                                          *
+ *                                                                          *
+ *  PURPOSE    : Row and canvas mode version of PILGIFPushForward().        *
+ *                                                                          *
+ ****************************************************************************/
+//
+// Without the whole frame in memory in stream order, strings can't be copied
+// from earlier output by offset; each code links to its prefix code and the
+// chain is walked back to front. A string that fits in the current row is
+// written there directly, one that crosses into the next row is unwound on a
+// small stack first.
+// With bCopy the rows stay where they were written (frame in place or canvas)
+// and, like PILGIFPushForward(), a code remembers where its string first landed
+// (u32Pos), so a string that sits in one row and has no transparent pixels is
+// copied forward from there instead of walking the chain.
+// iPixelShift selects what's written: 0 = indices, 1 = RGB565, 2 = ARGB.
+// Strings outside the visible part of the row (PILGIFLZWSetView()) are
+// decoded but not written.
+// The arguments after iLen are always constants; each combination is compiled
+// into its own loop by the wrappers below, so the hot path tests no modes.
+//
+PIL_GIF_KERNEL int PILGIFRowKernel(PIL_GIF_LZW *pLZW, unsigned char *pData, int iLen, const int iPixelShift, const PILBOOL bTransparent, const PILBOOL bCopy)
+{
+int iBitCount, iErr, iCopyLen, x, iWidth, iTransparent, n, x0, x1;
+int iPos, iOldPos, iRowX0, iRowX1;
+unsigned short iNew;
+unsigned short oldcode, codesize, nextcode, nextlim, cc, eoi, sMask, code, c;
+int iBlockRest;
+unsigned char *pRow, *pFrame, *s, *d, *ps, *pSrc, *pSrcEnd, *pDataEnd, ucFirst;
+unsigned short *ds, *ss, *pusPalette;
+uint32_t *pLinks, *pLengths, *pPos, u32, *pul, *psl, *pulPalette;
+uint64_t ulBits;
+
+	if (pLZW->bDone)
+		return 0;
+	iErr = 0;
+	pSrc = pData;
+	GIFBITS_START(pLZW, pData, iLen, pSrcEnd, pDataEnd, iBlockRest);
+	pLinks = pLZW->u32Offsets;
+	pLengths = pLZW->u32Lengths;
+	pPos = pLZW->u32Pos;
+	pRow = pLZW->pRow;
+	pFrame = pLZW->pFrame;
+	iWidth = pLZW->iWidth;
+	iRowX0 = pLZW->iRowX0;
+	iRowX1 = pLZW->iRowX1;
+	pusPalette = (unsigned short *)pLZW->pCanvasPalette;
+	pulPalette = (uint32_t *)pLZW->pCanvasPalette;
+	iTransparent = (bTransparent) ? pLZW->iTransparent : -1;
+	// work on local copies, the state is only written back on the way out
+	ulBits = pLZW->ulBits;
+	iBitCount = pLZW->iBitCount;
+	x = pLZW->iX;
+	iOldPos = pLZW->iOldOffset;
+	codesize = pLZW->codesize;
+	sMask = pLZW->sMask;
+	nextcode = pLZW->nextcode;
+	nextlim = pLZW->nextlim;
+	oldcode = pLZW->oldcode;
+	cc = pLZW->cc;
+	eoi = pLZW->eoi;
+	while (1)
+	{
+		if (iBitCount < codesize)
+		{
+			GIFBITS_REFILL(ulBits, iBitCount, pSrc, pSrcEnd);
+			GIFBITS_NEXTBLOCK(pLZW, ulBits, iBitCount, codesize, pSrc, pSrcEnd, pDataEnd, iBlockRest, lzwrows_exit, lzwrows_done);
+		}
+		code = (unsigned short) ulBits & sMask;
+		ulBits >>= codesize;
+		iBitCount -= codesize;
+		if (code == cc)
+		{
+			codesize = pLZW->codestart + 1;
+			sMask = (1 << codesize) - 1;
+			nextcode = cc + 2;
+			nextlim = 1 << codesize;
+			oldcode = CT_END;
+			continue;
+		}
+		if (code == eoi)
+			break;
+		iNew = 0; // code added to the table this time (0 = none)
+		if (oldcode != CT_END)
+		{
+			if (code > nextcode)
+			{
+				iErr = PIL_ERROR_DECOMP; /* Corrupt data */
+				break;
+			}
+			if (nextcode < PIL_GIF_MAXCODE)
+			{
+				ucFirst = (unsigned char)(pLinks[oldcode] >> 16);
+				if (code == nextcode) // KwKwK case, ends with its own first pixel
+					c = ucFirst;
+				else
+					c = (unsigned char)(pLinks[code] >> 16);
+				pLinks[nextcode] = GIF_ROW_LINK(oldcode, ucFirst, c);
+				u32 = pLengths[oldcode] + 1;
+				if (bTransparent && c == iTransparent)
+					u32 |= GIF_LEN_TRANSPARENT;
+				pLengths[nextcode] = u32;
+				// previous string + first pixel of this one, if they're next to each other
+				if (bCopy)
+					pPos[nextcode] = (iOldPos >= 0) ? (uint32_t)iOldPos : GIF_NO_POS;
+				iNew = nextcode++;
+				if (nextcode >= nextlim && codesize < 12)
+				{
+					codesize++;
+					nextlim <<= 1;
+					sMask = (sMask << 1) | 1;
+				}
+			}
+		}
+		else if (code > cc)
+		{
+			iErr = PIL_ERROR_DECOMP; /* first code after a clear must be a root code */
+			break;
+		}
+		oldcode = code;
+		if (code < cc) /* Root code, just a single pixel */
+		{
+			if (x >= iRowX0 && x < iRowX1)
+			{
+				if (iPixelShift == 0)
+					pRow[x] = (unsigned char)code;
+				else if (!bTransparent || code != iTransparent)
+				{
+					if (iPixelShift == 1)
+						((unsigned short *)pRow)[x] = pusPalette[code];
+					else
+						((uint32_t *)pRow)[x] = pulPalette[code];
+				}
+				if (bCopy)
+					iOldPos = (int)(pRow - pFrame) + (x << iPixelShift);
+			}
+			else // hidden, don't write it or point new codes at it
+			{
+				if (bCopy && iNew)
+					pPos[iNew] = GIF_NO_POS;
+				iOldPos = -1;
+			}
+			if (++x == iWidth)
+			{
+				x = 0;
+				iOldPos = -1; // the next pixel isn't adjacent
+				if (PILGIFRowDone(pLZW))
+					break;
+				pRow = pLZW->pRow;
+				iRowX0 = pLZW->iRowX0;
+				iRowX1 = pLZW->iRowX1;
+			}
+			continue;
+		}
+		u32 = pLengths[code];
+		iCopyLen = (int)(u32 & ~GIF_LEN_TRANSPARENT);
+		if (x + iCopyLen <= iWidth) /* Fits in this row */
+		{
+			iPos = (int)(pRow - pFrame) + (x << iPixelShift);
+			if (x >= iRowX1 || x + iCopyLen <= iRowX0) /* Hidden, skip it */
+			{
+				if (bCopy && iNew)
+					pPos[iNew] = GIF_NO_POS;
+				iPos = -1;
+			}
+			else if (bCopy && (!bTransparent || !(u32 & GIF_LEN_TRANSPARENT)) && pPos[code] != GIF_NO_POS)
+			{
+				// The whole string was already written, copy it forward
+				// (it can overlap the destination in the KwKwK case)
+				if (iPixelShift == 0)
+				{
+					ps = &pFrame[pPos[code]];
+					d = &pFrame[iPos];
+					for (n=0; n<iCopyLen; n++)
+						d[n] = ps[n];
+				}
+				else if (iPixelShift == 1)
+				{
+					ss = (unsigned short *)&pFrame[pPos[code]];
+					ds = (unsigned short *)&pFrame[iPos];
+					for (n=0; n<iCopyLen; n++)
+						ds[n] = ss[n];
+				}
+				else
+				{
+					psl = (uint32_t *)&pFrame[pPos[code]];
+					pul = (uint32_t *)&pFrame[iPos];
+					for (n=0; n<iCopyLen; n++)
+						pul[n] = psl[n];
+				}
+			}
+			else if (iPixelShift == 0) /* Walk the chain back to front */
+			{
+				d = &pRow[x + iCopyLen - 1];
+				while (code >= cc)
+				{
+					u32 = pLinks[code];
+					*d-- = (unsigned char)(u32 >> 24);
+					code = (unsigned short)u32;
+				}
+				*d = (unsigned char)code;
+			}
+			else if (iPixelShift == 1)
+			{
+				ds = &((unsigned short *)pRow)[x + iCopyLen - 1];
+				while (code >= cc)
+				{
+					u32 = pLinks[code];
+					c = (unsigned short)(u32 >> 24);
+					if (!bTransparent || c != iTransparent)
+						*ds = pusPalette[c];
+					ds--;
+					code = (unsigned short)u32;
+				}
+				if (!bTransparent || code != iTransparent)
+					*ds = pusPalette[code];
+			}
+			else
+			{
+				pul = &((uint32_t *)pRow)[x + iCopyLen - 1];
+				while (code >= cc)
+				{
+					u32 = pLinks[code];
+					c = (unsigned short)(u32 >> 24);
+					if (!bTransparent || c != iTransparent)
+						*pul = pulPalette[c];
+					pul--;
+					code = (unsigned short)u32;
+				}
+				if (!bTransparent || code != iTransparent)
+					*pul = pulPalette[code];
+			}
+			x += iCopyLen;
+			if (bCopy)
+				iOldPos = iPos;
+			if (x == iWidth)
+			{
+				x = 0;
+				iOldPos = -1; // the next pixel isn't adjacent
+				if (PILGIFRowDone(pLZW))
+					break;
+				pRow = pLZW->pRow;
+				iRowX0 = pLZW->iRowX0;
+				iRowX1 = pLZW->iRowX1;
+			}
+		}
+		else /* Crosses one or more rows, unwind it on the stack first */
+		{
+			s = &pLZW->ucStack[PIL_GIF_MAXCODE];
+			while (code >= cc)
+			{
+				u32 = pLinks[code];
+				*(--s) = (unsigned char)(u32 >> 24);
+				code = (unsigned short)u32;
+			}
+			*(--s) = (unsigned char)code;
+			if (bCopy && iNew && (x < iRowX0 || x >= iRowX1)) // the first pixel won't be written
+				pPos[iNew] = GIF_NO_POS;
+			iOldPos = -1;
+			while (iCopyLen > 0)
+			{
+				n = iWidth - x;
+				if (n > iCopyLen)
+					n = iCopyLen;
+				x0 = (x > iRowX0) ? x : iRowX0; // visible part of this piece
+				x1 = (x + n < iRowX1) ? x + n : iRowX1;
+				if (x1 > x0)
+					PILGIFPutPixels(pLZW, &pRow[x0 << iPixelShift], &s[x0 - x], x1 - x0, iPixelShift, bTransparent);
+				s += n;
+				x += n;
+				iCopyLen -= n;
+				if (x == iWidth)
+				{
+					x = 0;
+					if (PILGIFRowDone(pLZW))
+						goto lzwrows_done;
+					pRow = pLZW->pRow;
+					iRowX0 = pLZW->iRowX0;
+					iRowX1 = pLZW->iRowX1;
+				}
+			}
+		}
+	} /* while not end of LZW code stream */
+lzwrows_done:
+	pLZW->bDone = TRUE; /* EOI, full frame or bad data */
+lzwrows_exit:
+	pLZW->iBlockLeft = (int)(pSrcEnd - pSrc) + iBlockRest;
+	pLZW->ulBits = ulBits;
+	pLZW->iBitCount = iBitCount;
+	pLZW->iX = x;
+	pLZW->iOldOffset = iOldPos;
+	pLZW->iOffset = pLZW->iRowCount * iWidth + x;
+	pLZW->codesize = codesize;
+	pLZW->sMask = sMask;
+	pLZW->nextcode = nextcode;
+	pLZW->nextlim = nextlim;
+	pLZW->oldcode = oldcode;
+	return iErr;
+} /* PILGIFRowKernel() */
+
+/****************************************************************************
+ *                                                                          *
+ *  FUNCTION   : PILGIFPushRow8() etc.                                      *
+ *                                                                          *
+ *  PURPOSE    : The row mode decoders, one per output format.              *
+ *                                                                          *
+ ****************************************************************************/
+static int PILGIFPushRow8(PIL_GIF_LZW *pLZW, unsigned char *pData, int iLen)
+{ // single row reused for every row, nothing to copy from
+	return PILGIFRowKernel(pLZW, pData, iLen, 0, FALSE, FALSE);
+}
+static int PILGIFPushFrame8(PIL_GIF_LZW *pLZW, unsigned char *pData, int iLen)
+{ // rows written in place
+	return PILGIFRowKernel(pLZW, pData, iLen, 0, FALSE, TRUE);
+}
+static int PILGIFPushCanvas16(PIL_GIF_LZW *pLZW, unsigned char *pData, int iLen)
+{
+	return PILGIFRowKernel(pLZW, pData, iLen, 1, FALSE, TRUE);
+}
+static int PILGIFPushCanvas16T(PIL_GIF_LZW *pLZW, unsigned char *pData, int iLen)
+{
+	return PILGIFRowKernel(pLZW, pData, iLen, 1, TRUE, TRUE);
+}
+static int PILGIFPushCanvas32(PIL_GIF_LZW *pLZW, unsigned char *pData, int iLen)
+{
+	return PILGIFRowKernel(pLZW, pData, iLen, 2, FALSE, TRUE);
+}
+static int PILGIFPushCanvas32T(PIL_GIF_LZW *pLZW, unsigned char *pData, int iLen)
+{
+	return PILGIFRowKernel(pLZW, pData, iLen, 2, TRUE, TRUE);
+}
+
+/****************************************************************************
+ *                                                                          *
+ *  FUNCTION   : PILGIFPushForward()                                        *
+ *                                                                          *
+ *  PURPOSE    : Decode as much of the frame as the new data allows.        *
+ *                                                                          *
+ ****************************************************************************/
+//
+// Every string in the dictionary has already been written to the output
+// exactly once, so each code only needs the offset and length of its first
+// appearance. A new code is always the previous string plus the first pixel of
+// the current one and those are adjacent in the output, so the new entry is
+// just the previous offset with a length 1 longer. Emitting a code becomes a
+// single forward copy instead of walking the linked list backwards.
+// A code split across two pushes stays in the bit accumulator until the
+// rest of it arrives.
+//
+static int PILGIFPushForward(PIL_GIF_LZW *pLZW, unsigned char *pData, int iLen)
+{
+int iBitCount, iErr, iSize, iCopyLen, iBlockRest;
+int iOffset, iOldOffset, iOldLen;
+unsigned short oldcode, codesize, nextcode, nextlim, cc, eoi, sMask, code;
+unsigned char *buf, *s, *d, *pEnd, *pSrc, *pSrcEnd, *pDataEnd;
+uint64_t ulBits;
+
+	if (pLZW->bDone)
+		return 0;
+	iErr = 0;
+	pSrc = pData;
+	GIFBITS_START(pLZW, pData, iLen, pSrcEnd, pDataEnd, iBlockRest);
+	// work on local copies, the state is only written back on the way out
+	ulBits = pLZW->ulBits;
+	iBitCount = pLZW->iBitCount;
+	iOffset = pLZW->iOffset;
+	iOldOffset = pLZW->iOldOffset;
+	iOldLen = pLZW->iOldLen;
+	iSize = pLZW->iSize;
+	buf = pLZW->pOut;
+	codesize = pLZW->codesize;
+	sMask = pLZW->sMask;
+	nextcode = pLZW->nextcode;
+	nextlim = pLZW->nextlim;
+	oldcode = pLZW->oldcode;
+	cc = pLZW->cc;
+	eoi = pLZW->eoi;
+	while (iOffset < iSize)
+	{
+		if (iBitCount < codesize)
+		{
+			GIFBITS_REFILL(ulBits, iBitCount, pSrc, pSrcEnd);
+			GIFBITS_NEXTBLOCK(pLZW, ulBits, iBitCount, codesize, pSrc, pSrcEnd, pDataEnd, iBlockRest, lzwpush_exit, lzwpush_done);
+		}
+		code = (unsigned short) ulBits & sMask;
+		ulBits >>= codesize;
+		iBitCount -= codesize;
+		if (code == cc)
+		{
+			codesize = pLZW->codestart + 1;
+			sMask = (1 << codesize) - 1;
+			nextcode = cc + 2;
+			nextlim = 1 << codesize;
+			oldcode = CT_END;
+			continue;
+		}
+		if (code == eoi)
+			break;
+		if (oldcode != CT_END)
+		{
+			if (code > nextcode)
+			{
+				iErr = PIL_ERROR_DECOMP; /* Corrupt data */
+				break;
+			}
+			if (nextcode < PIL_GIF_MAXCODE)
+			{
+				// previous string + first pixel of this one (they're adjacent in the output)
+				// this also takes care of the new code being used right away
+				pLZW->u32Offsets[nextcode] = iOldOffset;
+				pLZW->u32Lengths[nextcode] = iOldLen + 1;
+				nextcode++;
+				if (nextcode >= nextlim && codesize < 12)
+				{
+					codesize++;
+					nextlim <<= 1;
+					sMask = (sMask << 1) | 1;
+				}
+			}
+		}
+		else if (code > cc)
+		{
+			iErr = PIL_ERROR_DECOMP; /* first code after a clear must be a root code */
+			break;
+		}
+		if (code < cc) /* Root code, just a single pixel */
+		{
+			buf[iOffset] = (unsigned char)code;
+			iCopyLen = 1;
+		}
+		else
+		{
+			iCopyLen = pLZW->u32Lengths[code];
+			// Make sure data does not write past end of buffer
+			if (iCopyLen > (iSize - iOffset))
+				iCopyLen = iSize - iOffset;
+			s = &buf[pLZW->u32Offsets[code]];
+			d = &buf[iOffset];
+			pEnd = &d[iCopyLen];
+#ifdef _X86
+			if (d - s >= 4) // source and destination can't overlap within 4 bytes
+			{
+				while (d < pEnd) // most frequent are 1-3 bytes in length, copy 4 bytes in these cases too
+				{
+					*(uint32_t *)d = *(uint32_t *)s;
+					d += 4; s += 4;
+				}
+			}
+			else
+#endif
+			{
+				while (d < pEnd)
+					*d++ = *s++;
+			}
+		}
+		oldcode = code;
+		iOldOffset = iOffset;
+		iOldLen = iCopyLen;
+		iOffset += iCopyLen;
+	} /* while not end of LZW code stream */
+lzwpush_done:
+	pLZW->bDone = TRUE; /* EOI, full frame or bad data */
+lzwpush_exit:
+	pLZW->iBlockLeft = (int)(pSrcEnd - pSrc) + iBlockRest;
+	pLZW->ulBits = ulBits;
+	pLZW->iBitCount = iBitCount;
+	pLZW->iOffset = iOffset;
+	pLZW->iOldOffset = iOldOffset;
+	pLZW->iOldLen = iOldLen;
+	pLZW->codesize = codesize;
+	pLZW->sMask = sMask;
+	pLZW->nextcode = nextcode;
+	pLZW->nextlim = nextlim;
+	pLZW->oldcode = oldcode;
+	return iErr;
+} /* PILGIFPushForward() */
+
+/****************************************************************************
+ *                                                                          *
+ *  FUNCTION   : PILGIFLZWPush()                                            *
+ *                                                                          *
+ *  PURPOSE    : Decode as much of the frame as the new data allows.        *
+ *                                                                          *
+ ****************************************************************************/
+//
+// pData is plain LZW data, the sub-blocks (if any) already joined together.
+//
+int PILGIFLZWPush(PIL_GIF_LZW *pLZW, unsigned char *pData, int iLen)
+{
+	pLZW->bSubBlocks = FALSE;
+	return (*pLZW->pfnPush)(pLZW, pData, iLen);
+} /* PILGIFLZWPush() */
+
+/****************************************************************************
+ *                                                                          *
+ *  FUNCTION   : PILGIFLZWPushBlocks()                                      *
+ *                                                                          *
+ *  PURPOSE    : Decode as much of the frame as the new data allows.        *
+ *                                                                          *
+ ****************************************************************************/
+//
+// pData is the frame's data as stored in the file: length-prefixed sub-blocks
+// ending with a zero length. The bit reader walks them itself and skips each
+// length byte as it gets to it, so the file bytes are decoded where they are
+// without gathering the sub-blocks first or a call per sub-block. The data
+// can be split anywhere, also in the middle of a sub-block.
+//
+int PILGIFLZWPushBlocks(PIL_GIF_LZW *pLZW, unsigned char *pData, int iLen)
+{
+	pLZW->bSubBlocks = TRUE;
+	return (*pLZW->pfnPush)(pLZW, pData, iLen);
+} /* PILGIFLZWPushBlocks() */
+
+/****************************************************************************
+ *                                                                          *
+ *  FUNCTION   : PILGIFPushBlocks()                                         *
+ *                                                                          *
+ *  PURPOSE    : Feed a frame's LZW data to the decoder.                    *
+ *                                                                          *
+ ****************************************************************************/
+//
+// With bSubBlocks the data is still in the file's length-prefixed sub-blocks;
+// otherwise it was already joined together.
+//
+void PILGIFPushBlocks(PIL_GIF_LZW *pLZW, unsigned char *pSrc, int iLen, PILBOOL bSubBlocks)
+{
+	if (bSubBlocks)
+		PILGIFLZWPushBlocks(pLZW, pSrc, iLen);
+	else
+		PILGIFLZWPush(pLZW, pSrc, iLen);
+} /* PILGIFPushBlocks() */
+
+/****************************************************************************
+ *                                                                          *
+ *  FUNCTION   : PILGIFDecodeFrame()                                        *
+ *                                                                          *
+ *  PURPOSE    : Decode a GIF frame from joined LZW data or directly from   *
+ *               its sub-blocks.                                            *
+ *                                                                          *
+ ****************************************************************************/
+//
+// pSrc points to the LZW minimum code size byte.
+// 4-bpp images are decoded 1 byte per pixel and packed at the end, unless
+// PIL_CONVERT_8BPP asks for the unpacked pixels (then the output is 8-bpp).
+// Interlaced frames go through the row decoder, which writes each row straight
+// to its final position.
+//
+int PILGIFDecodeFrame(PIL_GIF_LZW *pContext, PIL_PAGE *InPage, PIL_PAGE *OutPage, int iMap, unsigned char *pSrc, int iLen, PILBOOL bSubBlocks, int iOptions)
+{
+int iErr, lsize, iUncompressedLen;
+unsigned char *buf;
+PIL_GIF_LZW *pLZW;
+
+	iErr = 0;
+	buf = NULL;
+	if (iLen < 1)
+		return PIL_ERROR_DECOMP;
+	pLZW = pContext;
+	if (pLZW == NULL) // no context from the caller, use a temporary one
+	{
+		pLZW = PILGIFLZWCreate();
+		if (pLZW == NULL)
+			return PIL_ERROR_MEMORY;
+	}
+	iUncompressedLen = InPage->iWidth * InPage->iHeight;
+	if (InPage->cBitsperpixel == 4 && !(iOptions & PIL_CONVERT_8BPP))
+	{
+		lsize = PILCalcSize(InPage->iWidth, 4);
+		OutPage->iDataSize = lsize * InPage->iHeight;
+		if (!(iOptions & PIL_CONVERT_NOALLOC))
+			OutPage->pData = (unsigned char *) PILIOAlloc(OutPage->iDataSize);
+		if (OutPage->pData == NULL)
+		{
+			iErr = PIL_ERROR_MEMORY;
+			goto gifframe_error;
+		}
+		buf = PILGIFLZWScratch(pLZW, iUncompressedLen + 4); /* 4 extra bytes for overshooting copies */
+		if (buf == NULL)
+		{
+			iErr = PIL_ERROR_MEMORY;
+			goto gifframe_error;
+		}
+	}
+	else
+	{
+		// The output doubles as the dictionary, so the rows can't have any padding
+		lsize = InPage->iWidth;
+		OutPage->iDataSize = iUncompressedLen;
+		if (!(iOptions & PIL_CONVERT_NOALLOC))
+			OutPage->pData = (unsigned char *) PILIOAlloc(iUncompressedLen + 4); /* 4 extra bytes for overshooting copies */
+		if (OutPage->pData == NULL)
+		{
+			iErr = PIL_ERROR_MEMORY;
+			goto gifframe_error;
+		}
+		buf = OutPage->pData;
+	}
+	OutPage->iPitch = lsize;
+	if (buf == OutPage->pData)
+		OutPage->cBitsperpixel = 8;
+	if (iMap & 0x40) /* Interlaced, write each row to its final position */
+		iErr = PILGIFLZWInitRows(pLZW, pSrc[0], InPage->iWidth, InPage->iHeight, TRUE, buf, InPage->iWidth, NULL, NULL);
+	else
+		iErr = PILGIFLZWInit(pLZW, pSrc[0], buf, iUncompressedLen);
+	if (iErr)
+		goto gifframe_error;
+	PILGIFPushBlocks(pLZW, &pSrc[1], iLen - 1, bSubBlocks);
+	if (pLZW->iOffset < iUncompressedLen && !(iOptions & PIL_CONVERT_IGNORE_ERRORS))
+	{
+		iErr = PIL_ERROR_DECOMP; // short page
+		goto gifframe_error;
+	}
+	if (buf != OutPage->pData)
+		PILGIFPack4(buf, OutPage->pData, InPage->iWidth, InPage->iHeight, lsize);
+	OutPage->cCompression = PIL_COMP_NONE;
+	if (pLZW != pContext)
+		PILGIFLZWDestroy(pLZW);
+	return 0;
+gifframe_error:
+	if (pLZW != pContext)
+		PILGIFLZWDestroy(pLZW);
+	if (!(iOptions & PIL_CONVERT_NOALLOC))
+	{
+		PILIOFree(OutPage->pData); /* Free the image buffer */
+		OutPage->pData = NULL;
+	}
+	return iErr;
+} /* PILGIFDecodeFrame() */
+
+/****************************************************************************
+ *                                                                          *
+ *  FUNCTION   : PILFastLZW()                                               *
+ *                                                                          *
+ *  PURPOSE    : Decompress a GIF image whose sub-blocks were joined        *
+ *               together (flags byte, code size byte, LZW data).           *
+ *                                                                          *
+ ****************************************************************************/
+//
+// Only a page that holds its own copy of the joined data can be decoded
+// here. PILReadGIF() leaves pData NULL for a loaded or mapped file, and
+// those frames have to go through PILDecodeGIF() with their PIL_FILE.
+//
+int PILFastLZW(PIL_PAGE *InPage, PIL_PAGE *OutPage, int iOptions)
+{
+unsigned char *p;
+
+	if (InPage->pData == NULL) // a frame header without its data
+		return PIL_ERROR_INVPARAM;
+	p = &InPage->pData[InPage->iOffset];
+	return PILGIFDecodeFrame(NULL, InPage, OutPage, p[0], &p[1], InPage->iDataSize - 1, FALSE, iOptions);
+} /* PILFastLZW() */
+
+/****************************************************************************
+ *                                                                          *
+ *  FUNCTION   : PILLZWPrepOutput()                                         *
+ *                                                                          *
+ *  PURPOSE    : Copy the palettes and image info to the output page.       *
  *                                                                          *
  ****************************************************************************/
-int LZWCopyBytes(unsigned char *buf, int iOffset, int iUncompressedLen, uint32_t *pSymbols)
+//
+// Palettes already allocated on the output page (a page that's reused for
+// every frame) are overwritten instead of allocated again.
+//
+void PILLZWPrepOutput(PIL_PAGE *InPage, PIL_PAGE *OutPage)
 {
-int iLen;
-unsigned char *s, *d;
-#ifdef _X86
-int iTempLen;
-#else
-unsigned char *pEnd;
-#endif
-
-    iLen = pSymbols[SYM_LENGTHS];
-    // Make sure data does not write past end of buffer (which does occur frequently)
-    if (iLen > (iUncompressedLen - iOffset))
-       iLen = iUncompressedLen - iOffset;
-    s = &buf[pSymbols[SYM_OFFSETS]];
-    d = &buf[iOffset];
-#ifdef _X86
-	iTempLen = iLen;
-	while (iTempLen > 0) // most frequent are 1-3 bytes in length, copy 4 bytes in these cases too
+	// With the palette cache, a frame using the same color table as the last
+	// one has nothing to copy; its global table was copied with that frame
+	if (InPage->pPalette != NULL && (InPage->pGIFPalette == NULL || OutPage->pGIFPalette != InPage->pGIFPalette || OutPage->pPalette == NULL))
 	{
-		*(uint32_t *)d = *(uint32_t *) s;
-		d += 4; s += 4;
-		iTempLen -= 4;
+		if (OutPage->pPalette == NULL)
+			OutPage->pPalette = PILIOAlloc(768);
+		if (OutPage->pPalette)
+			memcpy(OutPage->pPalette, InPage->pPalette, 768); // copy to destination page
 	}
-	d += iTempLen; // in case we overshot
-#else
-	pEnd = &d[iLen];
-	while (d < pEnd)
-       *d++ = *s++;
-#endif
-	if (pSymbols[SYM_EXTRAS] != -1) // was a newly used code
+	if (InPage->pLocalPalette != NULL)
 	{
-		*d = buf[pSymbols[SYM_EXTRAS]];
-		iLen++;
-		// since the code with extension byte has now been written to the output, fix the code
-		pSymbols[SYM_OFFSETS] = iOffset;
-		pSymbols[SYM_EXTRAS] = 0xffffffff;
-		pSymbols[SYM_LENGTHS]++;
-//		pSymbols[SYM_LENGTHS] = iLen; - this is slower on x86, but faster on ARM
+		if (OutPage->pLocalPalette == NULL)
+			OutPage->pLocalPalette = PILIOAlloc(768);
+		if (OutPage->pLocalPalette)
+			memcpy(OutPage->pLocalPalette, InPage->pLocalPalette, 768);
 	}
-    return iLen;
-
-} /* LZWCopyBytes() */
+	else if (OutPage->pLocalPalette != NULL) // left over from an earlier frame
+	{
+		PILIOFree(OutPage->pLocalPalette);
+		OutPage->pLocalPalette = NULL;
+	}
+	OutPage->pGIFPalette = InPage->pGIFPalette;
+	OutPage->cBitsperpixel = InPage->cBitsperpixel;
+	OutPage->iWidth = InPage->iWidth;
+	OutPage->iHeight = InPage->iHeight;
+	OutPage->iFrameDelay = InPage->iFrameDelay;
+	OutPage->iX = InPage->iX; // frame position and transparency for PILAnimateGIF()
+	OutPage->iY = InPage->iY;
+	OutPage->cGIFBits = InPage->cGIFBits;
+	OutPage->iTransparent = InPage->iTransparent;
+	OutPage->iPitch = PILCalcSize(InPage->iWidth, InPage->cBitsperpixel);
+} /* PILLZWPrepOutput() */
 
 /****************************************************************************
  *                                                                          *
@@ -845,8 +2769,8 @@ unsigned char *pEnd;
 int PILDecodeLZW(PIL_PAGE *InPage, PIL_PAGE *OutPage, PILBOOL bGIF, int iOptions)
 {
 	int i, y, iTotalY, xcount;
-	int bitnum, bitoff, lsize, iMap;
-	int iDelta, iStripNum;
+	int bitnum, bitoff, lsize;
+	int iStripNum;
 	unsigned short oldcode, codesize, nextcode, nextlim;
 	unsigned short *giftabs, cc, eoi;
 	signed short sMask;
@@ -862,38 +2786,19 @@ int PILDecodeLZW(PIL_PAGE *InPage, PIL_PAGE *OutPage, PILBOOL bGIF, int iOptions
 	unsigned short code;
 	PILBOOL bMoreStrips = FALSE;
 	int iPlanarAdjust = 1;
-	// if output can be used for string table, do it faster
-//	   if (bGIF && (OutPage->cBitsperpixel == 8 && ((OutPage->iWidth & 3) == 0)))
-//	      return PILFastLZW(InPage, OutPage, bGIF, iOptions);
 
 	irlcptr = pOutPtr = NULL; // suppress compiler warning
 	index = NULL;
 
-	if (InPage->pPalette != NULL)
-	{
-		OutPage->pPalette = PILIOAlloc(768);
-		memcpy(OutPage->pPalette, InPage->pPalette, 768); // copy to destination page
-	}
-	if (InPage->pLocalPalette != NULL)
-	{
-		OutPage->pLocalPalette = PILIOAlloc(768);
-		memcpy(OutPage->pLocalPalette, InPage->pLocalPalette, 768);
-	}
-	OutPage->cBitsperpixel = InPage->cBitsperpixel;
-	OutPage->iWidth = InPage->iWidth;
-	OutPage->iHeight = InPage->iHeight;
-	OutPage->iFrameDelay = InPage->iFrameDelay;
-	OutPage->iPitch = PILCalcSize(InPage->iWidth, InPage->cBitsperpixel);
+	PILLZWPrepOutput(InPage, OutPage);
+	// GIF has its own decoder and bit reader (LSB first, never reads past the data)
+	// so everything below only has to deal with TIFF. It needs the joined
+	// sub-blocks in InPage->pData (PIL_ERROR_INVPARAM otherwise), see PILFastLZW()
+	if (bGIF)
+		return PILFastLZW(InPage, OutPage, iOptions);
 
-	/* Code limit is different for TIFF and GIF */
-	if (!bGIF)
-	{
-		iDelta = 1;
-		//      if (OutPage->cBitsperpixel == 1) // TIFF LZW has the photometric inverted for our use
-		//         OutPage->cPhotometric = 1 - OutPage->cPhotometric;
-	}
-	else
-		iDelta = 0;
+	//      if (OutPage->cBitsperpixel == 1) // TIFF LZW has the photometric inverted for our use
+	//         OutPage->cPhotometric = 1 - OutPage->cPhotometric;
 	templine = NULL; /* Suppress compiler warning */
 	OutPage->iOffset = 0; // new data offset is 0 (for our uncompressed output)
 	if (InPage->cBitsperpixel == 1)
@@ -916,26 +2821,21 @@ int PILDecodeLZW(PIL_PAGE *InPage, PIL_PAGE *OutPage, PILBOOL bGIF, int iOptions
 	}
 	else /* Color image */
 	{
-		if (!bGIF)
+		if (InPage->cPhotometric == PIL_PHOTOMETRIC_YCBCR) // special case for YCbCr images
 		{
-			if (InPage->cPhotometric == PIL_PHOTOMETRIC_YCBCR) // special case for YCbCr images
-			{
-				int iMCU = 3; // assume 1:1 subsampling
-				if (InPage->cJPEGSubSample == 0x21) // horizontal only
-					iMCU = 4; // 2 Y, 1 Cb, 1Cr
-				else // we only support 2:1 and 2:2 subsampling
-					iMCU = 6; // 4 Y, 1 Cb, 1Cr
-				lsize = InPage->iWidth * iMCU;
-				if (InPage->cJPEGSubSample == 0x22)
-					lsize /= 2;
-			}
-			else
-			{
-				lsize = PILCalcBSize(InPage->iWidth, InPage->cBitsperpixel); // must be TIFF
-			}
+			int iMCU = 3; // assume 1:1 subsampling
+			if (InPage->cJPEGSubSample == 0x21) // horizontal only
+				iMCU = 4; // 2 Y, 1 Cb, 1Cr
+			else // we only support 2:1 and 2:2 subsampling
+				iMCU = 6; // 4 Y, 1 Cb, 1Cr
+			lsize = InPage->iWidth * iMCU;
+			if (InPage->cJPEGSubSample == 0x22)
+				lsize /= 2;
 		}
 		else
-			lsize = PILCalcSize(InPage->iWidth, InPage->cBitsperpixel);
+		{
+			lsize = PILCalcBSize(InPage->iWidth, InPage->cBitsperpixel);
+		}
 		i = lsize * (InPage->iHeight + 1); /* color bitmap size - can leak past the end of the last line*/
 		if (!(iOptions & PIL_CONVERT_NOALLOC))
 			OutPage->pData = (unsigned char *) PILIOAlloc(i); /* Output buffer is actual bitmap */
@@ -943,7 +2843,7 @@ int PILDecodeLZW(PIL_PAGE *InPage, PIL_PAGE *OutPage, PILBOOL bGIF, int iOptions
 		if (OutPage->pData == NULL)
 			return PIL_ERROR_MEMORY;
 		buf = pOutPtr = OutPage->pData;
-		if (!bGIF && InPage->cFlags & PIL_PAGEFLAGS_PLANAR) // different rules for planar image; one plane = width bytes
+		if (InPage->cFlags & PIL_PAGEFLAGS_PLANAR) // different rules for planar image; one plane = width bytes
 			lsize = InPage->iWidth;
 	}
 	p = &InPage->pData[InPage->iOffset];
@@ -958,18 +2858,8 @@ int PILDecodeLZW(PIL_PAGE *InPage, PIL_PAGE *OutPage, PILBOOL bGIF, int iOptions
 		iEndRow = InPage->iRowCount;
 	}
 
-	if (!bGIF)
-	{
-		codestart = 8; /* Always 8 bits for TIFF LZW */
-		bitoff = 0;
-		iMap = 0; /* Don't let it get accidentally un-interlaced */
-	}
-	else
-	{
-		iMap = p[0]; /* Get the GIF flags */
-		codestart = p[1]; /* Starting code size */
-		bitoff = 2; /* Offset into data */
-	}
+	codestart = 8; /* Always 8 bits for TIFF LZW */
+	bitoff = 0;
 	sMask = -1 << (codestart + 1);
 	sMask = 0xffff - sMask;
 	cc = (sMask >> 1) + 1; /* Clear code */
@@ -993,16 +2883,11 @@ int PILDecodeLZW(PIL_PAGE *InPage, PIL_PAGE *OutPage, PILBOOL bGIF, int iOptions
 		bMoreStrips = TRUE; // fool it into decoding n * height lines, otherwise we'll just decode red
 	}
 lzwdoitagain: /* Go here to do more strips */
-	if (!bGIF)
-	{
-		if (InPage->cPhotometric == PIL_PHOTOMETRIC_YCBCR) // special case for YCbCr images
-			xcount = lsize;
-		else
-			xcount = PILCalcBSize(InPage->iWidth, InPage->cBitsperpixel);
-		if (InPage->cFlags & PIL_PAGEFLAGS_PLANAR) // different rules for planar image; one plane = width bytes
-			xcount = InPage->iWidth;
-	}
+	if (InPage->cPhotometric == PIL_PHOTOMETRIC_YCBCR) // special case for YCbCr images
+		xcount = lsize;
 	else
+		xcount = PILCalcBSize(InPage->iWidth, InPage->cBitsperpixel);
+	if (InPage->cFlags & PIL_PAGEFLAGS_PLANAR) // different rules for planar image; one plane = width bytes
 		xcount = InPage->iWidth;
 	bitnum = 0;
 	// Initialize code table
@@ -1021,54 +2906,30 @@ init_codetable:
 	sMask = -1 << (codestart + 1);
 	sMask = 0xffff - sMask;
 	nextcode = cc + 2;
-	nextlim = (unsigned short) ((1 << codesize) - iDelta);
+	nextlim = (unsigned short) ((1 << codesize) - 1); /* TIFF LZW switches code size one code early */
 	// This part of the table needs to be reset multiple times
 	memset(&giftabs[CTLINK + cc], CT_OLD, (4096 - cc)*sizeof(short));
 	oldcode = CT_END;
 	code = CT_END;
 #ifdef _64BITS
-	if (bGIF)
-		ulBits = INTELEXTRALONG(&p[bitoff]);
-	else
-		ulBits = MOTOEXTRALONG(&p[bitoff]);
+	ulBits = MOTOEXTRALONG(&p[bitoff]);
 #else
-	if (bGIF)
-		ulBits = INTELLONG(&p[bitoff]);
-	else
-		ulBits = MOTOLONG(&p[bitoff]);
+	ulBits = MOTOLONG(&p[bitoff]);
 #endif
 	while (code != eoi && y > 0 && y < InPage->iHeight+1) /* Loop through all lines of the image (or strip) */
 	{
-		if (!bGIF)
-		{
-			if (bitnum > (REGISTER_WIDTH - codesize))
-			{
-				bitoff += (bitnum >> 3);
-				bitnum &= 7;
-#ifdef _64BITS
-				ulBits = MOTOEXTRALONG(&p[bitoff]);
-#else
-				ulBits = MOTOLONG(&p[bitoff]);
-#endif
-			}
-			code = (unsigned short) (ulBits >> (REGISTER_WIDTH - codesize - bitnum));
-			code &= sMask;
-		}
-		else
+		if (bitnum > (REGISTER_WIDTH - codesize))
 		{
-			if (bitnum > (REGISTER_WIDTH - codesize))
-			{
-				bitoff += (bitnum >> 3);
-				bitnum &= 7;
+			bitoff += (bitnum >> 3);
+			bitnum &= 7;
 #ifdef _64BITS
-				ulBits = INTELEXTRALONG(&p[bitoff]);
+			ulBits = MOTOEXTRALONG(&p[bitoff]);
 #else
-				ulBits = INTELLONG(&p[bitoff]);
+			ulBits = MOTOLONG(&p[bitoff]);
 #endif
-			}
-			code = (unsigned short) (ulBits >> bitnum); /* Read a 32-bit chunk */
-			code &= sMask;
 		}
+		code = (unsigned short) (ulBits >> (REGISTER_WIDTH - codesize - bitnum));
+		code &= sMask;
 		bitnum += codesize;
 		if (code == cc) /* Clear code?, and not first code */
 			goto init_codetable;
@@ -1090,11 +2951,11 @@ init_codetable:
 				{
 					codesize++;
 					nextlim <<= 1;
-					nextlim += (unsigned short) iDelta; /* TIFF LZW irregularity */
+					nextlim++; /* TIFF LZW irregularity */
 					sMask = (sMask << 1) | 1;
 				}
 			}
-			buf = PILMakeGifPels(giftabs, templine, linebuf, code, &xcount, buf, &y, OutPage, &irlcptr, lsize, bGIF);
+			buf = PILMakeGifPels(giftabs, templine, linebuf, code, &xcount, buf, &y, OutPage, &irlcptr);
 			if (buf == NULL)
 				goto lzwnextline; /* Leave with error */
 			oldcode = code;
@@ -1149,38 +3010,6 @@ lzwnextline:
 		goto giferror; // short page, report error
 gifshort:
 		OutPage->cCompression = PIL_COMP_NONE;
-		if (iMap & 0x40) /* Interlaced? */
-		{ /* re-order the scan lines */
-			unsigned char *buf2;
-			int iDest, iGifPass = 0;
-			i = lsize * InPage->iHeight; /* color bitmap size */
-			buf = (unsigned char *) OutPage->pData; /* reset ptr to start of bitmap */
-			buf2 = (unsigned char *) PILIOAlloc(i);
-			if (buf2 == NULL)
-			{
-				PILIOFree(giftabs);
-				PILIOFree(linebuf);
-				if (!(iOptions & PIL_CONVERT_NOALLOC))
-					PILIOFree(OutPage->pData); /* Free the image buffer */
-				return PIL_ERROR_MEMORY;
-			}
-			y = 0;
-			for (i = 0; i<InPage->iHeight; i++)
-			{
-				iDest = y * lsize;
-				bitoff = i * lsize;
-				memcpy(&buf2[iDest], &buf[bitoff], lsize);
-				y += cGIFPass[iGifPass * 2];
-				if (y >= InPage->iHeight)
-				{
-					iGifPass++;
-					y = cGIFPass[iGifPass * 2 + 1];
-				}
-			}
-			PILIOFree(buf); /* Free the old buffer */
-			i = lsize * InPage->iHeight; /* color bitmap size */
-			OutPage->pData = buf2; /* Replace with corrected bitmap */
-		} /* If interlaced GIF */
 	PILIOFree(giftabs);
 	PILIOFree(linebuf);
     // Planes must be merged BEFORE applying the predictor
@@ -1190,7 +3019,7 @@ gifshort:
 //        if (i != PIL_ERROR_SUCCESS)
 //            return i; // error
 //    }
-	if (!bGIF && InPage->cFlags & PIL_PAGEFLAGS_PREDICTOR) /* Check for horizontal differencing */
+	if (InPage->cFlags & PIL_PAGEFLAGS_PREDICTOR) /* Check for horizontal differencing */
 	{
 		PILTIFFHoriz(OutPage, TRUE); /* Perform horizontal differencing */
 	}
@@ -1254,58 +3083,255 @@ gif_forced_error:
 
 /****************************************************************************
  *                                                                          *
- *  FUNCTION   : PILCountGIFPages()                                         *
+ *  FUNCTION   : PILDecodeGIF()                                             *
  *                                                                          *
- *  PURPOSE    : Determine the number of pages in a GIF file.               *
+ *  PURPOSE    : Decompress a GIF frame prepared by PILReadGIF().           *
  *                                                                          *
  ****************************************************************************/
-void PILCountGIFPages(PIL_FILE *pFile)
+//
+// The LZW sub-blocks are decoded where they sit (in the loaded file or in
+// the page data the caller read), so nothing has to be joined or copied first.
+//
+int PILDecodeGIF(PIL_FILE *pFile, PIL_PAGE *InPage, PIL_PAGE *OutPage, int iOptions)
+{
+unsigned char *p;
+
+	p = PILGIFPageData(pFile, InPage);
+	if (p == NULL || InPage->cCompression != PIL_COMP_GIF)
+		return PIL_ERROR_INVPARAM;
+	PILLZWPrepOutput(InPage, OutPage);
+	OutPage->iOffset = 0;
+	return PILGIFDecodeFrame(pFile->pGIFLZW, InPage, OutPage, InPage->cGIFMap, p, InPage->iDataSize, TRUE, iOptions);
+} /* PILDecodeGIF() */
+
+/****************************************************************************
+ *                                                                          *
+ *  FUNCTION   : PILDecodeGIFRows()                                         *
+ *                                                                          *
+ *  PURPOSE    : Decompress a GIF frame prepared by PILReadGIF() and pass   *
+ *               each row to a callback as soon as it's finished.           *
+ *                                                                          *
+ ****************************************************************************/
+//
+// Only a single row (1 byte per pixel) is allocated, so memory use doesn't
+// grow with the frame height. Rows of interlaced frames arrive in pass order
+// with their final y.
+//
+int PILDecodeGIFRows(PIL_FILE *pFile, PIL_PAGE *InPage, PILGIFROW pfnRow, void *pUser, int iOptions)
+{
+unsigned char *p, *pRow;
+PIL_GIF_LZW *pLZW;
+int iErr;
+
+	p = PILGIFPageData(pFile, InPage);
+	if (p == NULL || pfnRow == NULL || InPage->cCompression != PIL_COMP_GIF || InPage->iDataSize < 1)
+		return PIL_ERROR_INVPARAM;
+	if (InPage->iWidth == 0 || InPage->iHeight == 0)
+		return 0; // nothing to draw
+	pLZW = pFile->pGIFLZW;
+	if (pLZW == NULL) // no context from the caller, use a temporary one
+	{
+		pLZW = PILGIFLZWCreate();
+		if (pLZW == NULL)
+			return PIL_ERROR_MEMORY;
+	}
+	pRow = PILGIFLZWScratch(pLZW, InPage->iWidth);
+	if (pRow == NULL)
+	{
+		iErr = PIL_ERROR_MEMORY;
+		goto gifrows_exit;
+	}
+	iErr = PILGIFLZWInitRows(pLZW, p[0], InPage->iWidth, InPage->iHeight, (InPage->cGIFMap & 0x40), pRow, 0, pfnRow, pUser);
+	if (iErr)
+		goto gifrows_exit;
+	PILGIFPushBlocks(pLZW, &p[1], InPage->iDataSize - 1, TRUE);
+	if (pLZW->iRowCount < InPage->iHeight && !(iOptions & PIL_CONVERT_IGNORE_ERRORS))
+		iErr = PIL_ERROR_DECOMP; // short page
+gifrows_exit:
+	if (pLZW != pFile->pGIFLZW)
+		PILGIFLZWDestroy(pLZW);
+	return iErr;
+} /* PILDecodeGIFRows() */
+
+/****************************************************************************
+ *                                                                          *
+ *  FUNCTION   : PILDecodeGIFCanvas()                                       *
+ *                                                                          *
+ *  PURPOSE    : Decompress a GIF frame prepared by PILReadGIF() straight   *
+ *               onto the animation page.                                   *
+ *                                                                          *
+ ****************************************************************************/
+//
+// Does the work of PILDecodeGIF() + PILAnimateGIF() in a single pass: the
+// previous frame is disposed of, then each decoded string is converted to
+// RGB565/ARGB and written at the frame's position on pDestPage. No frame
+// buffer of palette indices is needed. A 24-bpp page is drawn a row at a time
+// through PILAnimateGIFLine() instead. Only the visible part of the page
+// (iViewX/iViewY/iViewCX/iViewCY) is drawn.
+//
+int PILDecodeGIFCanvas(PIL_FILE *pFile, PIL_PAGE *InPage, PIL_PAGE *pDestPage, int iOptions)
+{
+unsigned char *p, *pCanvas;
+PIL_GIF_LZW *pLZW;
+PIL_GIF_ANIM anim;
+void *pPalette;
+int iErr;
+
+	p = PILGIFPageData(pFile, InPage);
+	if (p == NULL || InPage->cCompression != PIL_COMP_GIF || InPage->iDataSize < 1)
+		return PIL_ERROR_INVPARAM;
+	iErr = PILAnimateGIFStart(pDestPage, InPage, &anim); // palette + disposal of the last frame
+	if (iErr)
+		return iErr;
+	if (InPage->iWidth == 0 || InPage->iHeight == 0)
+		goto gifcanvas_end; // nothing to draw
+	if (pDestPage->cBitsperpixel == 24 || pDestPage->cBitsperpixel == 8) // drawn a row at a time
+	{
+		anim.iSrcBpp = 8;
+		iErr = PILDecodeGIFRows(pFile, InPage, PILAnimateGIFLine, &anim, iOptions);
+		goto gifcanvas_end;
+	}
+	pLZW = pFile->pGIFLZW;
+	if (pLZW == NULL) // no context from the caller, use a temporary one
+	{
+		pLZW = PILGIFLZWCreate();
+		if (pLZW == NULL)
+		{
+			iErr = PIL_ERROR_MEMORY;
+			goto gifcanvas_end;
+		}
+	}
+	if (pDestPage->cBitsperpixel == 16)
+		pPalette = anim.pusPalette;
+	else
+		pPalette = anim.pulPalette;
+	pCanvas = pDestPage->pData + (InPage->iY * pDestPage->iPitch) + ((InPage->iX * pDestPage->cBitsperpixel) >> 3);
+	iErr = PILGIFLZWInitCanvas(pLZW, p[0], InPage->iWidth, InPage->iHeight, (InPage->cGIFMap & 0x40), pCanvas, pDestPage->iPitch, pDestPage->cBitsperpixel, pPalette, anim.iTransparent);
+	if (iErr == 0)
+	{
+		PILGIFLZWSetView(pLZW, anim.iVisX0, anim.iVisY0, anim.iVisX1, anim.iVisY1); // skip what can't be seen
+		PILGIFPushBlocks(pLZW, &p[1], InPage->iDataSize - 1, TRUE);
+		if (pLZW->iRowCount < InPage->iHeight && !(iOptions & PIL_CONVERT_IGNORE_ERRORS))
+			iErr = PIL_ERROR_DECOMP; // short page
+	}
+	if (pLZW != pFile->pGIFLZW)
+		PILGIFLZWDestroy(pLZW);
+gifcanvas_end:
+	PILAnimateGIFEnd(&anim);
+	return iErr;
+} /* PILDecodeGIFCanvas() */
+
+/****************************************************************************
+ *                                                                          *
+ *  FUNCTION   : PILScanGIFPages()                                          *
+ *                                                                          *
+ *  PURPOSE    : Find the pages of a GIF file, only as far as needed.       *
+ *                                                                          *
+ ****************************************************************************/
+//
+// The first call reads the screen descriptor and sets up the page list and
+// frame table; each call then walks the file until iPages pages are complete
+// (or the file ends) and stops there, so the first frames can be shown before
+// a large file has been scanned. While pGIFScan is set, iPageTotal is the
+// number of pages found so far and the next call picks up where this one left
+// off; once the end of the file is reached the scan state is freed and
+// iPageTotal is final. Returns iPageTotal.
+//
+int PILScanGIFPages(PIL_FILE *pFile, int iPages)
 {
-int iOff, iNumPages;
+int iNumPages;
 int iReadAmount;
-int iDataAvailable = 0;
-int iDataRemaining = 0;
+PILOffset iOff, iDataAvailable, iDataRemaining; // a loaded file can be over 2GB
 int iBufferSize, iHighWater;
-uint32_t lFileOff = 0;
+PILOffset lFileOff;
 PILBOOL bDone = FALSE;
 PILBOOL bExt;
 unsigned char c, *cBuf;
+PIL_GIF_FRAME *pFrame;
+PIL_GIF_SCAN *pScan;
 
-    iBufferSize = 0x100000; // 1MB should be good
-    iHighWater = iBufferSize - 512;
-   iNumPages = 0;
-   iDataRemaining = pFile->iFileSize;
-   pFile->pPageList = (int *)PILIOAlloc(MAX_PAGES * sizeof(int));
-   if (pFile->pPageList == NULL)
-	   return;
-//   pFile->pSoundList = PILIOAlloc(MAX_PAGES * sizeof(int)); // page delays
-   pFile->pPageList[iNumPages++] = 0; /* First page starts at 0 */
-   if (pFile->cState == PIL_FILE_STATE_LOADED) // use provided pointer
-      {
-      cBuf = pFile->pData;
-	  iDataAvailable = pFile->iFileSize;
-      }
-   else
+   pScan = pFile->pGIFScan;
+   if (pScan == NULL) // not started yet or already at the end
       {
-	   cBuf = (unsigned char *) PILIOAlloc(iBufferSize);
-	  iDataAvailable = PILReadAtOffset(pFile, 0, cBuf, iBufferSize); // read some data to start
+      if (pFile->pGIFFrames != NULL)
+         return pFile->iPageTotal;
+      pScan = (PIL_GIF_SCAN *)PILIOAlloc(sizeof(PIL_GIF_SCAN));
+      if (pScan == NULL)
+         return 0;
+      // The table starts small and doubles as pages are found, so a sticker
+      // costs a few hundred bytes and a long capture has no page limit
+      pScan->iFrameMax = 16;
+      pFile->pGIFFrames = (PIL_GIF_FRAME *)PILIOAlloc(pScan->iFrameMax * sizeof(PIL_GIF_FRAME));
+      if (pFile->pGIFFrames == NULL)
+         {
+         PILIOFree(pScan);
+         return 0;
+         }
+      pFile->pGIFScan = pScan;
+      iBufferSize = 0x100000; // 1MB should be good
+      iHighWater = iBufferSize - 512;
+      iNumPages = 0;
+      lFileOff = 0;
+      iDataRemaining = pFile->iFileSize;
+      pFile->pGIFFrames[iNumPages++].iOffset = 0; /* First page starts at 0 */
+      if (pFile->cState == PIL_FILE_STATE_LOADED) // use provided pointer
+         {
+         cBuf = pFile->pData;
+         iDataAvailable = pFile->iFileSize;
+         }
+      else
+         {
+         cBuf = (unsigned char *) PILIOAlloc(iBufferSize);
+         if (cBuf == NULL)
+            {
+            PILIOFree(pFile->pGIFFrames);
+            pFile->pGIFFrames = NULL;
+            PILIOFree(pScan);
+            pFile->pGIFScan = NULL;
+            return 0;
+            }
+         iDataAvailable = PILReadAtOffset(pFile, 0, cBuf, iBufferSize); // read some data to start
+         }
+      iOff = 6;
+      pFile->iX = cBuf[iOff] + (cBuf[iOff+1]<<8); // get width
+      iOff += 2;
+      pFile->iY = cBuf[iOff] + (cBuf[iOff+1]<<8); // get height
+      iOff += 2;
+      c = cBuf[iOff]; // get info bits
+      pFile->cBpp = cGIFBits[(c & 7)]; // bits per pixel of the page (converted to supported values)
+      iOff += 3;   /* Skip flags, background color & aspect ratio */
+      if (c & 0x80) /* Deal with global color table */
+         {
+         c &= 7;  /* Get the number of colors defined */
+         iOff += (2<<c)*3; /* skip color table */
+         }
       }
-   iOff = 6;
-   pFile->iX = cBuf[iOff] + (cBuf[iOff+1]<<8); // get width
-   iOff += 2;
-   pFile->iY = cBuf[iOff] + (cBuf[iOff+1]<<8); // get height
-   iOff += 2;
-   c = cBuf[iOff]; // get info bits
-   pFile->cBpp = cGIFBits[(c & 7)]; // bits per pixel of the page (converted to supported values)
-   iOff += 3;   /* Skip flags, background color & aspect ratio */
-   if (c & 0x80) /* Deal with global color table */
+   else // continue from where the last call stopped
       {
-      c &= 7;  /* Get the number of colors defined */
-      iOff += (2<<c)*3; /* skip color table */
+      cBuf = pScan->cBuf;
+      lFileOff = pScan->lFileOff;
+      iOff = pScan->iOff;
+      iNumPages = pScan->iNumPages;
+      iDataAvailable = pScan->iDataAvailable;
+      iDataRemaining = pScan->iDataRemaining;
+      iBufferSize = pScan->iBufferSize;
+      iHighWater = iBufferSize - 512;
       }
-   while (!bDone && iNumPages < MAX_PAGES)
+   while (!bDone)
       {
-//	  pFile->pSoundList[iNumPages] = 0; // assume no delay for this frame
+      if (iNumPages > iPages) // pages 0 to iNumPages-2 are complete, enough for now
+         {
+         pScan->cBuf = cBuf;
+         pScan->lFileOff = lFileOff;
+         pScan->iOff = iOff;
+         pScan->iNumPages = iNumPages;
+         pScan->iDataAvailable = iDataAvailable;
+         pScan->iDataRemaining = iDataRemaining;
+         pScan->iBufferSize = iBufferSize;
+         pFile->iPageTotal = iNumPages - 1; // the page just started isn't complete yet
+         return pFile->iPageTotal;
+         }
+      pFrame = &pFile->pGIFFrames[iNumPages-1]; // entry of the page being scanned
       bExt = TRUE; /* skip extension blocks */
       while (bExt && iOff < iDataAvailable)
          {
@@ -1322,13 +3348,11 @@ unsigned char c, *cBuf;
             case 0x21: /* Extension block */
                if (cBuf[iOff+1] == 0xf9 && cBuf[iOff+2] == 4) // Graphic Control Extension
                {
-            	   uint32_t ul;
-            	   // pack the 4 bytes into a long
-            	   ul = cBuf[iOff+3]; // page disposition flags
-            	   ul |= (cBuf[iOff+4] << 8); // delay low byte
-            	   ul |= (cBuf[iOff+5] << 16); // delay high byte
-            	   ul |= (cBuf[iOff+6] << 24); // transparent color index
-//             	   pFile->pSoundList[iNumPages] = (int)ul;
+                  pFrame->ucGIFBits = cBuf[iOff+3]; // packed fields
+                  pFrame->iFrameDelay = (INTELSHORT(&cBuf[iOff+4]))*10; // delay in ms
+                  if (pFrame->iFrameDelay < 30) // same substitute as PILReadGIF()
+                     pFrame->iFrameDelay = 100;
+                  pFrame->ucTransparent = cBuf[iOff+6]; // transparent color index
                }
                iOff += 2; /* skip to length */
                iOff += (int)cBuf[iOff]; /* Skip the data block */
@@ -1361,13 +3385,20 @@ unsigned char c, *cBuf;
          goto gifpagesz;
          }
       /* Start of image data */
+      pFrame->usX = INTELSHORT(&cBuf[iOff+1]);
+      pFrame->usY = INTELSHORT(&cBuf[iOff+3]);
+      pFrame->usWidth = INTELSHORT(&cBuf[iOff+5]);
+      pFrame->usHeight = INTELSHORT(&cBuf[iOff+7]);
       c = cBuf[iOff+9]; /* Get the flags byte */
+      pFrame->ucMap = c;
       iOff += 10; /* Skip image position and size */
+      pFrame->u32Palette = (uint32_t)(lFileOff + iOff - pFrame->iOffset);
       if (c & 0x80) /* Local color table */
          {
          c &= 7;
          iOff += (2<<c)*3;
          }
+      pFrame->u32Data = (uint32_t)(lFileOff + iOff - pFrame->iOffset);
       iOff++; /* Skip LZW code size byte */
       c = cBuf[iOff++];
       while (c) /* While there are more data blocks */
@@ -1376,48 +3407,319 @@ unsigned char c, *cBuf;
             {
             lFileOff += iOff; /* adjust total file pointer */
             iDataRemaining -= iOff;
-            iReadAmount = (iDataRemaining > iBufferSize) ? iBufferSize:iDataRemaining;
+            iReadAmount = (iDataRemaining > iBufferSize) ? iBufferSize : (int)iDataRemaining;
 			iDataAvailable = PILReadAtOffset(pFile, lFileOff, cBuf, iReadAmount); // read a new block
             iOff = 0; /* Start at beginning of buffer */
             }
          iOff += (int)c;  /* Skip this data block */
-         if ((int)lFileOff + iOff > pFile->iFileSize) // past end of file, stop
+         if (lFileOff + iOff > pFile->iFileSize) // past end of file, stop
             {
             iNumPages--; // don't count this page
             break; // last page is corrupted, don't use it
             }
          c = cBuf[iOff++]; /* Get length of next */
          }
+      // Move the window along once half of it has been used; the next page's
+      // extensions and descriptor then always sit inside it
+      if (pFile->cState != PIL_FILE_STATE_LOADED && iOff > iBufferSize/2 && iDataRemaining > iOff)
+         {
+         lFileOff += iOff; /* adjust total file pointer */
+         iDataRemaining -= iOff;
+         iReadAmount = (iDataRemaining > iBufferSize) ? iBufferSize : (int)iDataRemaining;
+         iDataAvailable = PILReadAtOffset(pFile, lFileOff, cBuf, iReadAmount); // read a new block
+         iOff = 0; /* Start at beginning of buffer */
+         }
       /* End of image data, check for more pages... */
-      if (((int)lFileOff + iOff > pFile->iFileSize) || cBuf[iOff] == 0x3b)
+      if ((lFileOff + iOff >= pFile->iFileSize) || cBuf[iOff] == 0x3b)
          {
          bDone = TRUE; /* End of file has been reached */
          }
       else /* More pages to scan */
          {
-         pFile->pPageList[iNumPages++] = lFileOff + iOff;
-         // read new page data starting at this offset
-         if (pFile->cState != PIL_FILE_STATE_LOADED &&
-            pFile->iFileSize > iBufferSize && iDataRemaining > 0) // since we didn't read the whole file in one shot
+         if (iNumPages == pScan->iFrameMax) // table is full, make it twice as big
             {
-            lFileOff += iOff; /* adjust total file pointer */
-            iDataRemaining -= iOff;
-			iReadAmount = (iDataRemaining > iBufferSize) ? iBufferSize : iDataRemaining;
-			iDataAvailable = PILReadAtOffset(pFile, lFileOff, cBuf, iReadAmount); // read a new block
-            iOff = 0; /* Start at beginning of buffer */
+            pFrame = (PIL_GIF_FRAME *)PILIOReAlloc(pFile->pGIFFrames, 2 * pScan->iFrameMax * sizeof(PIL_GIF_FRAME));
+            if (pFrame == NULL) // keep the pages found so far, the last one runs to the end of the file
+               break;
+            memset(&pFrame[pScan->iFrameMax], 0, pScan->iFrameMax * sizeof(PIL_GIF_FRAME));
+            pFile->pGIFFrames = pFrame;
+            pScan->iFrameMax *= 2;
             }
+         pFile->pGIFFrames[iNumPages++].iOffset = lFileOff + iOff;
          }
       } /* while !bDone */
 gifpagesz:
-      pFile->pPageList[iNumPages] = pFile->iFileSize; /* Store end of file for length calc */
-      pFile->iPageTotal = iNumPages;
-      if (iNumPages == 1) // no need for pagelist structure
-         {
-         PILIOFree(pFile->pPageList);
-         pFile->pPageList = NULL;
-         }
+      pFile->iPageTotal = iNumPages; // the last page runs to the end of the file
       if (pFile->cState != PIL_FILE_STATE_LOADED)
          PILIOFree(cBuf); // free the temp buffer
+      PILIOFree(pScan);
+      pFile->pGIFScan = NULL;
+      return pFile->iPageTotal;
+} /* PILScanGIFPages() */
 
+/****************************************************************************
+ *                                                                          *
+ *  FUNCTION   : PILCountGIFPages()                                         *
+ *                                                                          *
+ *  PURPOSE    : Determine the number of pages in a GIF file.               *
+ *                                                                          *
+ ****************************************************************************/
+void PILCountGIFPages(PIL_FILE *pFile)
+{
+   PILScanGIFPages(pFile, 0x7fffffff); // all of them
 } /* PILCountGIFPages() */
 
+/****************************************************************************
+ *                                                                          *
+ *  FUNCTION   : PILProbeGIF()                                              *
+ *                                                                          *
+ *  PURPOSE    : Gather a GIF file's size, frame count, duration, loop      *
+ *               count and color table use without decoding it.             *
+ *                                                                          *
+ ****************************************************************************/
+//
+// Everything comes from the page scan's frame table except the loop count,
+// which is in an application extension ahead of the first image descriptor.
+// Only that much of the start of the file is read again.
+//
+int PILProbeGIF(PIL_FILE *pFile, PIL_GIF_INFO *pInfo)
+{
+PIL_GIF_FRAME *pFrame;
+unsigned char *p, ucTemp[4096];
+int i, iOff, iLen, iColors;
+
+	memset(pInfo, 0, sizeof(PIL_GIF_INFO));
+	pInfo->iLoopCount = -1;
+	if (pFile->iFileSize < 13)
+		return PIL_ERROR_BADHEADER;
+	if (pFile->pGIFFrames == NULL || pFile->pGIFScan)
+		PILCountGIFPages(pFile);
+	if (pFile->pGIFFrames == NULL)
+		return PIL_ERROR_MEMORY;
+	if (pFile->iPageTotal <= 0)
+		return PIL_ERROR_BADHEADER;
+	pInfo->iWidth = pFile->iX;
+	pInfo->iHeight = pFile->iY;
+	pInfo->iFrames = pFile->iPageTotal;
+	for (i=0; i<pFile->iPageTotal; i++)
+	{
+		pFrame = &pFile->pGIFFrames[i];
+		pInfo->iDuration += pFrame->iFrameDelay;
+		if (pFrame->ucMap & 0x80) // local color table
+		{
+			iColors = 2 << (pFrame->ucMap & 7);
+			pInfo->iLocalPalettes++;
+			if (iColors > pInfo->iMaxLocalColors)
+				pInfo->iMaxLocalColors = iColors;
+		}
+	}
+	// The first page's extension blocks run from the end of the global
+	// color table to its image descriptor
+	iLen = (int)pFile->pGIFFrames[0].u32Palette - 10;
+	if (pFile->cState == PIL_FILE_STATE_LOADED)
+		p = pFile->pData;
+	else
+	{
+		if (iLen > (int)sizeof(ucTemp)) // the loop count is normally the first block
+			iLen = sizeof(ucTemp);
+		p = ucTemp;
+		iLen = PILReadAtOffset(pFile, 0, p, iLen);
+	}
+	if (iLen < 13)
+		return PIL_ERROR_BADHEADER;
+	iOff = 13;
+	if (p[10] & 0x80)
+	{
+		pInfo->iGlobalColors = 2 << (p[10] & 7);
+		iOff += pInfo->iGlobalColors * 3;
+	}
+	while (iOff + 2 < iLen && p[iOff] == 0x21)
+	{
+		if (p[iOff+1] == 0xff && p[iOff+2] == 11 && iOff + 18 <= iLen &&
+		    memcmp(&p[iOff+3], "NETSCAPE2.0", 11) == 0 && p[iOff+14] == 3 && p[iOff+15] == 1)
+		{
+			pInfo->iLoopCount = INTELSHORT(&p[iOff+16]);
+			break;
+		}
+		iOff += 2; // skip the introducer and label, then each sub-block
+		while (iOff < iLen && p[iOff] != 0)
+			iOff += p[iOff] + 1;
+		iOff++;
+	}
+	return PIL_ERROR_SUCCESS;
+} /* PILProbeGIF() */
+
+// Sidecar index file: this header followed by iPageTotal PIL_GIF_FRAME
+// entries, all in native byte order. An index written on a different kind of
+// machine or by another version fails the header check and is simply rebuilt.
+#define GIF_INDEX_MAGIC 0x58444947 /* "GIDX" */
+#define GIF_INDEX_VERSION (2 | (sizeof(PIL_GIF_FRAME) << 16))
+#define GIF_INDEX_HASHLEN 1024 /* bytes at the start of the GIF that are hashed */
+typedef struct gif_index_header
+{
+uint32_t u32Magic;
+uint32_t u32Version;       // format version and frame entry size
+PILOffset iFileSize;       // size of the GIF file
+uint32_t u32Stamp;         // caller's stamp (e.g. modification time)
+uint32_t u32Hash;          // hash of the start of the GIF file
+int iPageTotal;
+int iX, iY;                // page size
+int iBpp;
+} GIF_INDEX_HEADER;
+
+/****************************************************************************
+ *                                                                          *
+ *  FUNCTION   : PILGIFIndexHash()                                          *
+ *                                                                          *
+ *  PURPOSE    : Hash the start of a GIF file to tie an index to it.        *
+ *                                                                          *
+ ****************************************************************************/
+static uint32_t PILGIFIndexHash(PIL_FILE *pFile)
+{
+unsigned char ucTemp[GIF_INDEX_HASHLEN], *p;
+uint32_t u32Hash;
+int i, iLen;
+
+	iLen = (pFile->iFileSize < GIF_INDEX_HASHLEN) ? (int)pFile->iFileSize : GIF_INDEX_HASHLEN;
+	if (pFile->cState == PIL_FILE_STATE_LOADED)
+		p = pFile->pData;
+	else
+	{
+		p = ucTemp;
+		iLen = PILReadAtOffset(pFile, 0, ucTemp, iLen);
+	}
+	u32Hash = 2166136261U; // FNV-1a
+	for (i=0; i<iLen; i++)
+	{
+		u32Hash ^= p[i];
+		u32Hash *= 16777619U;
+	}
+	return u32Hash;
+} /* PILGIFIndexHash() */
+
+/****************************************************************************
+ *                                                                          *
+ *  FUNCTION   : PILWriteGIFIndex()                                         *
+ *                                                                          *
+ *  PURPOSE    : Save the page list and frame table of a GIF file so a      *
+ *               later PILReadGIFIndex() can skip PILScanGIFPages().        *
+ *                                                                          *
+ ****************************************************************************/
+//
+// u32Stamp is stored as given and must match on the way back in; the file's
+// modification time is the obvious choice. The index is written to a temp
+// file and renamed into place so a reader never sees half of it.
+//
+int PILWriteGIFIndex(PIL_FILE *pFile, TCHAR *szName, uint32_t u32Stamp)
+{
+GIF_INDEX_HEADER hdr;
+TCHAR *szTemp;
+void *ohandle;
+int iLen, iErr;
+
+	if (pFile->pGIFScan) // only a complete list can be saved
+		return PIL_ERROR_INVPARAM;
+	if (pFile->iPageTotal < 1 || pFile->pGIFFrames == NULL)
+		return PIL_ERROR_INVPARAM;
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.u32Magic = GIF_INDEX_MAGIC;
+	hdr.u32Version = GIF_INDEX_VERSION;
+	hdr.iFileSize = pFile->iFileSize;
+	hdr.u32Stamp = u32Stamp;
+	hdr.u32Hash = PILGIFIndexHash(pFile);
+	hdr.iPageTotal = pFile->iPageTotal;
+	hdr.iX = pFile->iX;
+	hdr.iY = pFile->iY;
+	hdr.iBpp = pFile->cBpp;
+	szTemp = (TCHAR *)PILIOAlloc(strlen(szName) + 5); // names of any length the OS accepts
+	if (szTemp == NULL)
+		return PIL_ERROR_MEMORY;
+	strcpy(szTemp, szName);
+	strcat(szTemp, ".tmp");
+	ohandle = PILIOCreate(szTemp);
+	if (ohandle == (void *)-1)
+	{
+		PILIOFree(szTemp);
+		return PIL_ERROR_IO;
+	}
+	iErr = 0;
+	iLen = hdr.iPageTotal * sizeof(PIL_GIF_FRAME);
+	if (PILIOWrite(ohandle, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+		PILIOWrite(ohandle, pFile->pGIFFrames, iLen) != (unsigned int)iLen)
+		iErr = PIL_ERROR_IO;
+	PILIOClose(ohandle);
+	if (!iErr && PILIORename(szTemp, szName) != 0)
+		iErr = PIL_ERROR_IO;
+	if (iErr)
+		PILIODelete(szTemp);
+	PILIOFree(szTemp);
+	return iErr;
+} /* PILWriteGIFIndex() */
+
+/****************************************************************************
+ *                                                                          *
+ *  FUNCTION   : PILReadGIFIndex()                                          *
+ *                                                                          *
+ *  PURPOSE    : Load the page list and frame table saved by                *
+ *               PILWriteGIFIndex() instead of calling PILScanGIFPages().   *
+ *                                                                          *
+ ****************************************************************************/
+//
+// Returns 0 and fills in the same PIL_FILE fields as a complete scan, or an
+// error if the index is missing, unreadable or was made for a different file
+// (size, stamp or header hash don't match); the caller then scans the file
+// and writes a fresh index.
+//
+int PILReadGIFIndex(PIL_FILE *pFile, TCHAR *szName, uint32_t u32Stamp)
+{
+GIF_INDEX_HEADER hdr;
+void *ihandle;
+PIL_GIF_FRAME *pFrames;
+PILOffset iEnd;
+int i, iLen, iErr;
+
+	ihandle = PILIOOpenRO(szName);
+	if (ihandle == (void *)-1)
+		return PIL_ERROR_FILENF;
+	pFrames = NULL;
+	iErr = PIL_ERROR_BADHEADER;
+	if (PILIORead(ihandle, &hdr, sizeof(hdr)) != sizeof(hdr))
+		goto gifindex_error;
+	// a page takes more than 16 bytes of the file, which also keeps iLen in range
+	if (hdr.u32Magic != GIF_INDEX_MAGIC || hdr.u32Version != GIF_INDEX_VERSION ||
+		hdr.iFileSize != pFile->iFileSize || hdr.u32Stamp != u32Stamp ||
+		hdr.iPageTotal < 1 || hdr.iPageTotal > pFile->iFileSize / 16 || hdr.iPageTotal > 0x7fffffff / (int)sizeof(PIL_GIF_FRAME))
+		goto gifindex_error;
+	if (hdr.u32Hash != PILGIFIndexHash(pFile))
+		goto gifindex_error;
+	iLen = hdr.iPageTotal * sizeof(PIL_GIF_FRAME);
+	pFrames = (PIL_GIF_FRAME *)PILIOAlloc(iLen);
+	if (pFrames == NULL)
+	{
+		iErr = PIL_ERROR_MEMORY;
+		goto gifindex_error;
+	}
+	if (PILIORead(ihandle, pFrames, iLen) != iLen)
+		goto gifindex_error;
+	// PILReadGIF() trusts these offsets, make sure they stay inside the file
+	for (i=0; i<hdr.iPageTotal; i++)
+	{
+		iEnd = (i + 1 < hdr.iPageTotal) ? pFrames[i+1].iOffset : pFile->iFileSize;
+		if (pFrames[i].iOffset < 0 || pFrames[i].iOffset >= iEnd || iEnd > pFile->iFileSize ||
+			pFrames[i].u32Palette == 0 || pFrames[i].u32Data < pFrames[i].u32Palette ||
+			pFrames[i].iOffset + pFrames[i].u32Data >= iEnd)
+			goto gifindex_error;
+	}
+	PILIOClose(ihandle);
+	pFile->pGIFFrames = pFrames;
+	pFile->iPageTotal = hdr.iPageTotal;
+	pFile->iX = hdr.iX;
+	pFile->iY = hdr.iY;
+	pFile->cBpp = (char)hdr.iBpp;
+	return 0;
+gifindex_error:
+	PILIOClose(ihandle);
+	if (pFrames)
+		PILIOFree(pFrames);
+	return iErr;
+} /* PILReadGIFIndex() */